@@ -1,7 +1,21 @@
 #include <Python.h>
 #include <structmember.h>
 
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
 #include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
 #include <linux/netfilter/nf_tables.h>
 
 #include <libmnl/libmnl.h>
@@ -78,12 +92,371 @@ static uint8_t _nf_nftnl_attr_spec_dict_get (PyObject* attr_dict, PyObject* attr
 
 // END: _nf_nftnl_attr_spec
 
+/* Element messages are cut at roughly BUFSIZ like libnftnl does. A batch page
+   is given enough slack past its limit to hold any single message. */
+#define NF_NFTNL_MSG_CHUNK BUFSIZ
+#define NF_NFTNL_BATCH_OVERRUN (UINT16_MAX + 1)
+
+// BEGIN: _nf_nftnl_set_elem_build
+
+/* One element of a NFTA_SET_ELEM_LIST_ELEMENTS nest, encoded by libnftnl
+   itself so that expressions and any attribute it learns later come along */
+static struct nlattr* _nf_nftnl_set_elem_build (struct nlmsghdr* nlh, struct nftnl_set_elem* elem, uint32_t index) {
+    struct nlattr* nest;
+    nest = mnl_attr_nest_start(nlh, index);
+    nftnl_set_elem_nlmsg_build_payload(nlh, elem);
+    mnl_attr_nest_end(nlh, nest);
+    return nest;
+}
+
+static void _nf_nftnl_set_elem_build_def (struct nlmsghdr* nlh, struct nftnl_set* set) {
+    if (nftnl_set_is_set(set, NFTNL_SET_NAME))
+        mnl_attr_put_strz(nlh, NFTA_SET_ELEM_LIST_SET, nftnl_set_get_str(set, NFTNL_SET_NAME));
+    if (nftnl_set_is_set(set, NFTNL_SET_ID))
+        mnl_attr_put_u32(nlh, NFTA_SET_ELEM_LIST_SET_ID, htonl(nftnl_set_get_u32(set, NFTNL_SET_ID)));
+    if (nftnl_set_is_set(set, NFTNL_SET_TABLE))
+        mnl_attr_put_strz(nlh, NFTA_SET_ELEM_LIST_TABLE, nftnl_set_get_str(set, NFTNL_SET_TABLE));
+}
+
+static struct nlattr* _nf_nftnl_set_key_build (struct nlmsghdr* nlh, const char* key, uint32_t key_len, uint32_t index) {
+    struct nlattr* nest1; struct nlattr* nest2;
+    nest1 = mnl_attr_nest_start(nlh, index);
+    nest2 = mnl_attr_nest_start(nlh, NFTA_SET_ELEM_KEY);
+    mnl_attr_put(nlh, NFTA_DATA_VALUE, key_len, key);
+    mnl_attr_nest_end(nlh, nest2);
+    mnl_attr_nest_end(nlh, nest1);
+    return nest1;
+}
+
+// END: _nf_nftnl_set_elem_build
+
+// BEGIN: _nf_nftnl_set_elem_parse
+
+typedef int (*_nf_nftnl_set_elem_cb) (const struct nlattr** tb, void* data);
+
+static void _nf_nftnl_attr_parse_nested (const struct nlattr* nest, const struct nlattr** tb, uint16_t max) {
+    const struct nlattr* attr; uint16_t type;
+    memset(tb, 0, sizeof(struct nlattr*) * (max + 1));
+    mnl_attr_for_each_nested(attr, nest) {
+        type = mnl_attr_get_type(attr);
+        if (type <= max) tb[type] = attr;
+    }
+}
+
+/* Returns the NFTA_DATA_VALUE carried by a NFTA_SET_ELEM_KEY/DATA nest */
+static const struct nlattr* _nf_nftnl_attr_data_value (const struct nlattr* nest) {
+    const struct nlattr* tb[NFTA_DATA_MAX + 1];
+    if (!nest)
+        return NULL;
+    _nf_nftnl_attr_parse_nested(nest, tb, NFTA_DATA_MAX);
+    return tb[NFTA_DATA_VALUE];
+}
+
+/* Calls cb with the attribute table of every element in a NEWSETELEM
+   message, without going through nftnl_set_elem objects */
+static int _nf_nftnl_set_elems_parse (const struct nlmsghdr* msg, _nf_nftnl_set_elem_cb cb, void* data) {
+    const struct nlattr* attr; const struct nlattr* elem;
+    const struct nlattr* tb[NFTA_SET_ELEM_MAX + 1];
+    int ret;
+
+    mnl_attr_for_each(attr, msg, sizeof(struct nfgenmsg)) {
+        if (mnl_attr_get_type(attr) != NFTA_SET_ELEM_LIST_ELEMENTS)
+            continue;
+        mnl_attr_for_each_nested(elem, attr) {
+            _nf_nftnl_attr_parse_nested(elem, tb, NFTA_SET_ELEM_MAX);
+            ret = cb(tb, data);
+            if (ret <= MNL_CB_STOP)
+                return ret;
+        }
+    }
+
+    return MNL_CB_OK;
+}
+
+// END: _nf_nftnl_set_elem_parse
+
+// BEGIN: _nf_nftnl_shard
+
+/* A contiguous slice of elements (or of a packed key buffer) encoded into
+   its own buffer by a worker thread. Sequence numbers are left at zero and
+   assigned when the shards are stitched back into the batch. */
+typedef struct {
+    uint16_t type; uint16_t family; uint16_t flags;
+    struct nftnl_set* set;
+    struct nftnl_set_elem** elems;
+    const char* keys; uint32_t key_len;
+    size_t start; size_t stop;
+    char* buffer; size_t len; size_t cap;
+    int error; const char* call;
+} _nf_nftnl_shard;
+
+static void* _nf_nftnl_shard_build (void* arg) {
+    _nf_nftnl_shard* shard = (_nf_nftnl_shard*) arg;
+    struct nlmsghdr* msg; struct nlattr* nest; struct nlattr* attr;
+    size_t i = shard->start; uint32_t index;
+    size_t cap; char* buffer;
+
+    while (i < shard->stop) {
+        if (shard->len + NF_NFTNL_MSG_CHUNK + NF_NFTNL_BATCH_OVERRUN > shard->cap) {
+            cap = shard->cap ? shard->cap * 2 : NF_NFTNL_MSG_CHUNK + NF_NFTNL_BATCH_OVERRUN;
+            buffer = realloc(shard->buffer, cap);
+            if (!buffer) {
+                shard->error = errno ? errno : ENOMEM;
+                shard->call = "realloc";
+                return NULL;
+            }
+            shard->buffer = buffer;
+            shard->cap = cap;
+        }
+
+        msg = nftnl_nlmsg_build_hdr(shard->buffer + shard->len, shard->type,
+                                    shard->family, shard->flags, 0);
+        _nf_nftnl_set_elem_build_def(msg, shard->set);
+
+        nest = mnl_attr_nest_start(msg, NFTA_SET_ELEM_LIST_ELEMENTS);
+        for (index = 1; i < shard->stop; i++, index++) {
+            if (shard->elems)
+                attr = _nf_nftnl_set_elem_build(msg, shard->elems[i], index);
+            else
+                attr = _nf_nftnl_set_key_build(msg, shard->keys + i * shard->key_len, shard->key_len, index);
+            if (msg->nlmsg_len > NF_NFTNL_MSG_CHUNK && index > 1) {
+                mnl_attr_nest_cancel(msg, attr);
+                break;
+            }
+        }
+        mnl_attr_nest_end(msg, nest);
+
+        shard->len += MNL_ALIGN(msg->nlmsg_len);
+    }
+
+    return NULL;
+}
+
+/* Splits [0, count) into up to `workers` shards and encodes them
+   concurrently. Must be called without holding the GIL. Returns 0, or the
+   errno of the first failure along with the name of the failing call. */
+static int _nf_nftnl_shard_run (_nf_nftnl_shard* shards, uint32_t workers, size_t count, const char** call) {
+    pthread_t* threads; uint32_t i; uint32_t started;
+
+    for (i = 0; i < workers; i++) {
+        shards[i].start = count * i / workers;
+        shards[i].stop = count * (i + 1) / workers;
+    }
+
+    if (workers == 1) {
+        _nf_nftnl_shard_build(&shards[0]);
+        *call = shards[0].call;
+        return shards[0].error;
+    }
+
+    threads = malloc(sizeof(pthread_t) * workers);
+    if (!threads) {
+        *call = "malloc";
+        return ENOMEM;
+    }
+
+    for (started = 0; started < workers; started++)
+        if (pthread_create(&threads[started], NULL, _nf_nftnl_shard_build, &shards[started]))
+            break;
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    /* Whatever could not be handed to a thread is encoded right here */
+    for (i = started; i < workers; i++)
+        _nf_nftnl_shard_build(&shards[i]);
+
+    free(threads);
+    for (i = 0; i < workers; i++)
+        if (shards[i].error) {
+            *call = shards[i].call;
+            return shards[i].error;
+        }
+    return 0;
+}
+
+// END: _nf_nftnl_shard
+
+// BEGIN: _nf_nftnl_set_backend
+
+/* What nft_select_set_ops gets to see of a set, and what each backend
+   estimates for it. Lookup and space costs are NFT_SET_CLASS_* values.
+   Sizes follow the estimate functions of net/netfilter/nft_set_*.c, with
+   the structure sizes of an x86_64 kernel as of Linux 6.x. */
+typedef struct {
+    uint32_t size; uint32_t klen; uint32_t field_count; uint32_t flags;
+    uint8_t field_len[NFT_REG32_COUNT];
+} _nf_nftnl_set_desc;
+
+enum {
+    NF_NFTNL_SET_CLASS_O_1,
+    NF_NFTNL_SET_CLASS_O_LOG_N,
+    NF_NFTNL_SET_CLASS_O_N,
+};
+
+typedef struct {
+    uint64_t size; int lookup; int space;
+} _nf_nftnl_set_estimate;
+
+typedef struct {
+    const char* name; uint32_t features;
+    int (*estimate) (const _nf_nftnl_set_desc* desc, _nf_nftnl_set_estimate* est);
+} _nf_nftnl_set_backend;
+
+/* sizeof(struct nft_hash) plus nft_hash_buckets(size) hlist_heads and one
+   struct nft_hash_elem (hlist_node and nft_set_ext header) per element */
+static uint64_t _nf_nftnl_hash_size (uint32_t size) {
+    uint64_t buckets = 1;
+    while (buckets < (uint64_t) size * 4 / 3)
+        buckets <<= 1;
+    return 8 + buckets * sizeof(void*) + (uint64_t) size * 32;
+}
+
+static int _nf_nftnl_hash_fast_estimate (const _nf_nftnl_set_desc* desc, _nf_nftnl_set_estimate* est) {
+    if (!desc->size || desc->klen != 4)
+        return 0;
+    est->size = _nf_nftnl_hash_size(desc->size);
+    est->lookup = NF_NFTNL_SET_CLASS_O_1;
+    est->space = NF_NFTNL_SET_CLASS_O_N;
+    return 1;
+}
+
+static int _nf_nftnl_hash_estimate (const _nf_nftnl_set_desc* desc, _nf_nftnl_set_estimate* est) {
+    if (!desc->size || desc->klen == 4)
+        return 0;
+    est->size = _nf_nftnl_hash_size(desc->size);
+    est->lookup = NF_NFTNL_SET_CLASS_O_1;
+    est->space = NF_NFTNL_SET_CLASS_O_N;
+    return 1;
+}
+
+static int _nf_nftnl_rhash_estimate (const _nf_nftnl_set_desc* desc, _nf_nftnl_set_estimate* est) {
+    est->size = UINT64_MAX;
+    est->lookup = NF_NFTNL_SET_CLASS_O_1;
+    est->space = NF_NFTNL_SET_CLASS_O_N;
+    return 1;
+}
+
+static int _nf_nftnl_bitmap_estimate (const _nf_nftnl_set_desc* desc, _nf_nftnl_set_estimate* est) {
+    if (desc->klen > 2)
+        return 0;
+    /* nft_bitmap_total_size: sizeof(struct nft_bitmap) and two bits per
+       possible key, one per generation */
+    est->size = 24 + ((uint64_t) 1 << (desc->klen * 8)) * 2 / 8;
+    est->lookup = NF_NFTNL_SET_CLASS_O_1;
+    est->space = NF_NFTNL_SET_CLASS_O_1;
+    return 1;
+}
+
+static int _nf_nftnl_rbtree_estimate (const _nf_nftnl_set_desc* desc, _nf_nftnl_set_estimate* est) {
+    if (desc->field_count > 1)
+        return 0;
+    /* sizeof(struct nft_rbtree) and one struct nft_rbtree_elem (rb_node and
+       nft_set_ext header) per element */
+    est->size = desc->size ? 32 + (uint64_t) desc->size * 40 : UINT64_MAX;
+    est->lookup = NF_NFTNL_SET_CLASS_O_LOG_N;
+    est->space = NF_NFTNL_SET_CLASS_O_N;
+    return 1;
+}
+
+/* pipapo_estimate_size: every n-bit field may expand to 2 * log2(n) rules
+   per element, each taking 16 buckets of one bit in the lookup table and an
+   8-byte nft_pipapo_map_bucket. On top come struct nft_pipapo, two struct
+   nft_pipapo_match and one struct nft_pipapo_field per field. */
+static uint64_t _nf_nftnl_pipapo_size (const _nf_nftnl_set_desc* desc) {
+    uint64_t entry_size = 0; uint32_t rules; uint32_t bits; uint32_t i;
+
+    for (i = 0; i < desc->field_count; i++) {
+        if (desc->field_len[i] > 16)
+            return 0;
+        for (rules = 0, bits = desc->field_len[i] * 8; bits > 1; bits >>= 1)
+            rules++;
+        rules *= 2;
+        entry_size += rules * 16 / 8 + rules * 8;
+    }
+
+    return (uint64_t) desc->size * entry_size + 32 + 2 * 32 + (uint64_t) desc->field_count * 32;
+}
+
+static int _nf_nftnl_pipapo_estimate (const _nf_nftnl_set_desc* desc, _nf_nftnl_set_estimate* est) {
+    if (!(desc->flags & NFT_SET_INTERVAL) || desc->field_count < 2)
+        return 0;
+    est->size = _nf_nftnl_pipapo_size(desc);
+    if (!est->size)
+        return 0;
+    est->lookup = NF_NFTNL_SET_CLASS_O_LOG_N;
+    est->space = NF_NFTNL_SET_CLASS_O_N;
+    return 1;
+}
+
+/* Only built into x86_64 kernels, and only offered on CPUs with AVX2 */
+static int _nf_nftnl_pipapo_avx2_estimate (const _nf_nftnl_set_desc* desc, _nf_nftnl_set_estimate* est) {
+#if defined(__x86_64__)
+    if (!__builtin_cpu_supports("avx2") || !__builtin_cpu_supports("avx"))
+        return 0;
+    return _nf_nftnl_pipapo_estimate(desc, est);
+#else
+    return 0;
+#endif
+}
+
+/* In the order the kernel registers them, which breaks ties */
+static _nf_nftnl_set_backend _nf_nftnl_set_backends [] = {
+    {"hash_fast", NFT_SET_MAP | NFT_SET_OBJECT, _nf_nftnl_hash_fast_estimate},
+    {"hash", NFT_SET_MAP | NFT_SET_OBJECT, _nf_nftnl_hash_estimate},
+    {"rhash", NFT_SET_MAP | NFT_SET_OBJECT | NFT_SET_TIMEOUT | NFT_SET_EVAL, _nf_nftnl_rhash_estimate},
+    {"bitmap", NFT_SET_OBJECT, _nf_nftnl_bitmap_estimate},
+    {"rbtree", NFT_SET_INTERVAL | NFT_SET_MAP | NFT_SET_OBJECT | NFT_SET_TIMEOUT, _nf_nftnl_rbtree_estimate},
+    {"pipapo_avx2", NFT_SET_INTERVAL | NFT_SET_MAP | NFT_SET_OBJECT | NFT_SET_TIMEOUT, _nf_nftnl_pipapo_avx2_estimate},
+    {"pipapo", NFT_SET_INTERVAL | NFT_SET_MAP | NFT_SET_OBJECT | NFT_SET_TIMEOUT, _nf_nftnl_pipapo_estimate},
+    {NULL}
+};
+
+/* Follows nft_select_set_ops: backends lacking a required feature are
+   skipped, and the estimates are compared according to the policy */
+static const _nf_nftnl_set_backend* _nf_nftnl_set_backend_select (const _nf_nftnl_set_desc* desc, uint32_t policy,
+                                                                  _nf_nftnl_set_estimate* best) {
+    const _nf_nftnl_set_backend* backend; const _nf_nftnl_set_backend* chosen = NULL;
+    _nf_nftnl_set_estimate est;
+    uint32_t flags = desc->flags & (NFT_SET_INTERVAL | NFT_SET_MAP | NFT_SET_TIMEOUT |
+                                    NFT_SET_OBJECT | NFT_SET_EVAL);
+
+    best->size = UINT64_MAX;
+    best->lookup = NF_NFTNL_SET_CLASS_O_N + 1;
+    best->space = NF_NFTNL_SET_CLASS_O_N + 1;
+
+    for (backend = _nf_nftnl_set_backends; backend->name; backend++) {
+        if ((flags & backend->features) != flags)
+            continue;
+        if (!backend->estimate(desc, &est))
+            continue;
+
+        if (policy == NFT_SET_POL_PERFORMANCE) {
+            if (!(est.lookup < best->lookup ||
+                  (est.lookup == best->lookup && est.space < best->space)))
+                continue;
+        } else if (!desc->size) {
+            if (!(est.space < best->space ||
+                  (est.space == best->space && est.lookup < best->lookup)))
+                continue;
+        } else if (chosen && est.size >= best->size) {
+            continue;
+        }
+
+        *best = est;
+        chosen = backend;
+    }
+
+    return chosen;
+}
+
+// END: _nf_nftnl_set_backend
+
 // BEGIN: NetfilterElementHandle
 
 typedef struct {
     PyObject_HEAD
     struct nftnl_set* owner;
     struct nftnl_set_elem* handle;
+    int busy;
 } NetfilterElementHandle;
 
 static PyObject* NetfilterElementHandle_new (PyTypeObject* type, PyTupleObject* args) {
@@ -91,6 +464,7 @@ static PyObject* NetfilterElementHandle_new (PyTypeObject* type, PyTupleObject*
     self = (NetfilterElementHandle*) type->tp_alloc(type, 0);
     self->owner = NULL;
     self->handle = NULL;
+    self->busy = 0;
     return (PyObject*) self;
 }
 
@@ -193,6 +567,10 @@ static int NetfilterElementHandle_SetAttr (NetfilterElementHandle* self, PyObjec
     PyObject* dict = NetfilterElementHandleAttributesDict;
     uint16_t attr_code; uint16_t attr_type; uint8_t attr_io;
     if (_nf_nftnl_attr_spec_dict_get(dict, name, &attr_code, &attr_type, &attr_io)) {
+        if (self->busy) {
+            PyErr_SetString(PyExc_OSError, "Element is being encoded by another thread");
+            return -1;
+        }
         if (attr_io & NF_NFTNL_ATTR_IO_WRITE) {
             switch (attr_type) {
                 case NF_NFTNL_ATTR_TYPE_RAW:
@@ -281,12 +659,22 @@ static PyTypeObject NetfilterElementHandleType = {
 typedef struct {
     PyObject_HEAD
     struct nftnl_set* handle;
+    PyObject* elements;
+    int busy;
 } NetfilterSetHandle;
 
 static PyObject* NetfilterSetHandle_new (PyTypeObject* type, PyTupleObject* args) {
     NetfilterSetHandle* self;
     self = (NetfilterSetHandle*) type->tp_alloc(type, 0);
+    if (!self)
+        return NULL;
     self->handle = NULL;
+    self->busy = 0;
+    self->elements = PyList_New(0);
+    if (!self->elements) {
+        Py_DECREF(self);
+        return NULL;
+    }
     return (PyObject*) self;
 }
 
@@ -294,13 +682,90 @@ static int NetfilterSetHandle_init (NetfilterSetHandle* self, PyTupleObject* arg
     return 0;
 }
 
+/* Hands the elements in [start, stop) back to their NetfilterElementHandle,
+   which then owns (and eventually frees) the underlying nftnl_set_elem. */
+static void _NetfilterSetHandle_detach (NetfilterSetHandle* self, Py_ssize_t start, Py_ssize_t stop) {
+    Py_ssize_t i;
+    for (i = start; i < stop; i++)
+        ((NetfilterElementHandle*) PyList_GET_ITEM(self->elements, i))->owner = NULL;
+}
+
+/* The removed elements are held until they are out of the list, so that
+   none of them is freed, or left in the set, with its owner cleared */
+static int _NetfilterSetHandle_release (NetfilterSetHandle* self, Py_ssize_t start, Py_ssize_t stop) {
+    PyObject* removed; Py_ssize_t i;
+
+    removed = PyList_GetSlice(self->elements, start, stop);
+    if (!removed)
+        return -1;
+
+    if (PyList_SetSlice(self->elements, start, stop, NULL) < 0) {
+        Py_DECREF(removed);
+        return -1;
+    }
+
+    for (i = 0; i < PyList_GET_SIZE(removed); i++)
+        ((NetfilterElementHandle*) PyList_GET_ITEM(removed, i))->owner = NULL;
+    Py_DECREF(removed);
+
+    return 0;
+}
+
+static int NetfilterSetHandle_traverse (NetfilterSetHandle* self, visitproc visit, void* arg) {
+    Py_VISIT(self->elements);
+    return 0;
+}
+
+/* Element handles may be subclassed and refer back to their set, so the
+   collector can break the cycle by handing every element back */
+static int NetfilterSetHandle_clear_refs (NetfilterSetHandle* self) {
+    if (self->elements && _NetfilterSetHandle_release(self, 0, PyList_GET_SIZE(self->elements)) < 0)
+        PyErr_Clear();
+    return 0;
+}
+
+/* The element list is only detached, not emptied: an iterator over the set
+   may still hold a reference to it */
 static void NetfilterSetHandle_dealloc (NetfilterSetHandle* self) {
-    nftnl_set_free(self->handle);
+    PyObject_GC_UnTrack((PyObject*) self);
+    if (self->elements) {
+        _NetfilterSetHandle_detach(self, 0, PyList_GET_SIZE(self->elements));
+        Py_DECREF(self->elements);
+    }
+    if (self->handle) nftnl_set_free(self->handle);
     Py_TYPE(self)->tp_free((PyObject*) self);
 }
 
 static PyObject* NetfilterSetHandleAttributesDict = NULL;
 
+/* Elements are spread over as many messages as needed so that none of them
+   grows past NF_NFTNL_MSG_CHUNK, the same limit libnftnl uses. Returns the
+   index of the first element that did not fit into msg. */
+static Py_ssize_t _NetfilterSetHandle_build_elems (NetfilterSetHandle* self, struct nlmsghdr* msg, Py_ssize_t start) {
+    struct nlattr* nest; struct nlattr* attr;
+    Py_ssize_t i; Py_ssize_t size; uint32_t index;
+    NetfilterElementHandle* element;
+
+    _nf_nftnl_set_elem_build_def(msg, self->handle);
+
+    size = PyList_GET_SIZE(self->elements);
+    if (start >= size)
+        return size;
+
+    nest = mnl_attr_nest_start(msg, NFTA_SET_ELEM_LIST_ELEMENTS);
+    for (i = start, index = 1; i < size; i++, index++) {
+        element = (NetfilterElementHandle*) PyList_GET_ITEM(self->elements, i);
+        attr = _nf_nftnl_set_elem_build(msg, element->handle, index);
+        if (msg->nlmsg_len > NF_NFTNL_MSG_CHUNK && index > 1) {
+            mnl_attr_nest_cancel(msg, attr);
+            break;
+        }
+    }
+    mnl_attr_nest_end(msg, nest);
+
+    return i;
+}
+
 static PyObject* NetfilterSetHandle_add (NetfilterSetHandle* self, PyTupleObject* args) {
     PyObject* object; NetfilterElementHandle* element;
 
@@ -321,12 +786,155 @@ static PyObject* NetfilterSetHandle_add (NetfilterSetHandle* self, PyTupleObject
         return NULL;
     }
 
-    nftnl_set_elem_add(self->handle, element->handle);
+    if (PyList_Append(self->elements, object) < 0)
+        return NULL;
     element->owner = self->handle;
 
     Py_RETURN_NONE;
 }
 
+static PyObject* NetfilterSetHandle_discard (NetfilterSetHandle* self, PyTupleObject* args) {
+    char* key; int keylen;
+    const void* raw; uint32_t rawlen;
+    NetfilterElementHandle* element;
+    Py_ssize_t i;
+
+    if (!PyArg_ParseTuple((PyObject*) args, "s#", &key, &keylen)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (bytes key)");
+        return NULL;
+    }
+
+    for (i = PyList_GET_SIZE(self->elements) - 1; i >= 0; i--) {
+        element = (NetfilterElementHandle*) PyList_GET_ITEM(self->elements, i);
+        if (!nftnl_set_elem_is_set(element->handle, NFTNL_SET_ELEM_KEY))
+            continue;
+        raw = nftnl_set_elem_get(element->handle, NFTNL_SET_ELEM_KEY, &rawlen);
+        if (rawlen == (uint32_t) keylen && memcmp(raw, key, rawlen) == 0 &&
+            _NetfilterSetHandle_release(self, i, i + 1) < 0)
+            return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyObject* NetfilterSetHandle_clear (NetfilterSetHandle* self) {
+    if (_NetfilterSetHandle_release(self, 0, PyList_GET_SIZE(self->elements)) < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+/* Describes the set to the kernel so that it picks a backend suited to the
+   expected load: desc_size presizes the hash backends (and caps the set to
+   that many elements), flags carry the interval/timeout/concatenation
+   needs, and the policy is MEMORY whenever that costs no lookup speed.
+   libnftnl counts the fields of NFTNL_SET_DESC_CONCAT on top of those it
+   already holds, so concatenation fields are set once and then kept. */
+static PyObject* NetfilterSetHandle_tune (NetfilterSetHandle* self, PyTupleObject* args) {
+    const _nf_nftnl_set_backend* performance; const _nf_nftnl_set_backend* memory;
+    _nf_nftnl_set_estimate performance_est; _nf_nftnl_set_estimate memory_est;
+    _nf_nftnl_set_desc desc;
+    PyObject* fields = NULL; PyObject* field;
+    const uint8_t* concat = NULL; uint32_t concat_len = 0;
+    uint32_t count; uint32_t flags; uint32_t key_len = 0;
+    long value; Py_ssize_t i;
+
+    if (!PyArg_ParseTuple((PyObject*) args, "II|O!", &count, &flags, &PyTuple_Type, &fields)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (uint32_t count, uint32_t flags, tuple fields=())");
+        return NULL;
+    }
+
+    if (self->busy) {
+        PyErr_SetString(PyExc_OSError, "Set is being encoded by another thread");
+        return NULL;
+    }
+
+    memset(&desc, 0, sizeof(desc));
+    if (fields && PyTuple_GET_SIZE(fields) > NFT_REG32_COUNT) {
+        PyErr_SetString(PyExc_ValueError, "A concatenated key must have between 1 and 16 fields");
+        return NULL;
+    }
+    for (i = 0; fields && i < PyTuple_GET_SIZE(fields); i++) {
+        field = PyTuple_GET_ITEM(fields, i);
+        value = PyInt_Check(field) ? PyInt_AsLong(field) : 0;
+        if (value < 1 || value > NFT_DATA_VALUE_MAXLEN) {
+            PyErr_SetString(PyExc_ValueError, "Key fields must be between 1 and 64 bytes long");
+            return NULL;
+        }
+        desc.field_len[i] = (uint8_t) value;
+        key_len += MNL_ALIGN(value);
+    }
+    desc.field_count = fields && PyTuple_GET_SIZE(fields) ? PyTuple_GET_SIZE(fields) : 1;
+
+    if (nftnl_set_is_set(self->handle, NFTNL_SET_DESC_CONCAT)) {
+        concat = nftnl_set_get_data(self->handle, NFTNL_SET_DESC_CONCAT, &concat_len);
+        if (!fields || !PyTuple_GET_SIZE(fields)) {
+            /* Tuned before: keep describing the same fields */
+            memcpy(desc.field_len, concat, concat_len < NFT_REG32_COUNT ? concat_len : NFT_REG32_COUNT);
+            desc.field_count = concat_len;
+        } else if (concat_len != desc.field_count || memcmp(concat, desc.field_len, concat_len)) {
+            PyErr_SetString(PyExc_ValueError, "Key fields cannot be changed once set");
+            return NULL;
+        }
+    }
+
+    if (nftnl_set_is_set(self->handle, NFTNL_SET_KEY_LEN)) {
+        if (key_len && key_len != nftnl_set_get_u32(self->handle, NFTNL_SET_KEY_LEN)) {
+            PyErr_SetString(PyExc_ValueError, "Key fields do not add up to the set key_len");
+            return NULL;
+        }
+        key_len = nftnl_set_get_u32(self->handle, NFTNL_SET_KEY_LEN);
+    }
+
+    if (!key_len || key_len > NFT_DATA_VALUE_MAXLEN) {
+        PyErr_SetString(PyExc_ValueError, "Set key_len must be set, or given as key fields");
+        return NULL;
+    }
+
+    /* INTERVAL and TIMEOUT come from the flags given, CONCAT follows the
+       fields: only what the set holds besides those is kept */
+    if (nftnl_set_is_set(self->handle, NFTNL_SET_FLAGS))
+        flags |= nftnl_set_get_u32(self->handle, NFTNL_SET_FLAGS) &
+                 (NFT_SET_ANONYMOUS | NFT_SET_CONSTANT | NFT_SET_MAP | NFT_SET_OBJECT | NFT_SET_EVAL);
+    if (desc.field_count > 1)
+        flags |= NFT_SET_CONCAT;
+
+    desc.size = count;
+    desc.klen = key_len;
+    desc.flags = flags;
+
+    performance = _nf_nftnl_set_backend_select(&desc, NFT_SET_POL_PERFORMANCE, &performance_est);
+    memory = _nf_nftnl_set_backend_select(&desc, NFT_SET_POL_MEMORY, &memory_est);
+    if (!performance || !memory) {
+        PyErr_SetString(PyExc_ValueError, "No set backend supports these flags");
+        return NULL;
+    }
+
+    nftnl_set_set_u32(self->handle, NFTNL_SET_KEY_LEN, key_len);
+    nftnl_set_set_u32(self->handle, NFTNL_SET_FLAGS, flags);
+    if (count)
+        nftnl_set_set_u32(self->handle, NFTNL_SET_DESC_SIZE, count);
+    else
+        nftnl_set_unset(self->handle, NFTNL_SET_DESC_SIZE);
+    if (desc.field_count > 1 && !concat)
+        nftnl_set_set_data(self->handle, NFTNL_SET_DESC_CONCAT, desc.field_len, desc.field_count);
+
+    if (memory_est.lookup == performance_est.lookup) {
+        nftnl_set_set_u32(self->handle, NFTNL_SET_POLICY, NFT_SET_POL_MEMORY);
+        return PyString_FromString(memory->name);
+    }
+
+    nftnl_set_set_u32(self->handle, NFTNL_SET_POLICY, NFT_SET_POL_PERFORMANCE);
+    return PyString_FromString(performance->name);
+}
+
+static Py_ssize_t NetfilterSetHandle_len (NetfilterSetHandle* self) {
+    return PyList_GET_SIZE(self->elements);
+}
+
+static PyObject* NetfilterSetHandle_iter (NetfilterSetHandle* self) {
+    return PyObject_GetIter(self->elements);
+}
+
 static PyObject* _NetfilterSetHandle_GetAttr_raw (NetfilterSetHandle* self, uint16_t attr) {
     const char* raw; uint32_t rawlen;
     raw = (const char*) nftnl_set_get_data(self->handle, attr, &rawlen);
@@ -415,6 +1023,10 @@ static int NetfilterSetHandle_SetAttr (NetfilterSetHandle* self, PyObject* name,
     PyObject* dict = NetfilterSetHandleAttributesDict;
     uint16_t attr_code; uint16_t attr_type; uint8_t attr_io;
     if (_nf_nftnl_attr_spec_dict_get(dict, name, &attr_code, &attr_type, &attr_io)) {
+        if (self->busy) {
+            PyErr_SetString(PyExc_OSError, "Set is being encoded by another thread");
+            return -1;
+        }
         if (attr_io & NF_NFTNL_ATTR_IO_WRITE) {
             switch (attr_type) {
                 case NF_NFTNL_ATTR_TYPE_RAW:
@@ -459,9 +1071,16 @@ static PyMemberDef NetfilterSetHandle_members[] = {
 
 static PyMethodDef NetfilterSetHandle_methods[] = {
     {"add", (PyCFunction) NetfilterSetHandle_add, METH_VARARGS, NULL},
+    {"discard", (PyCFunction) NetfilterSetHandle_discard, METH_VARARGS, NULL},
+    {"clear", (PyCFunction) NetfilterSetHandle_clear, METH_NOARGS, NULL},
+    {"tune", (PyCFunction) NetfilterSetHandle_tune, METH_VARARGS, NULL},
     {NULL}
 };
 
+static PySequenceMethods NetfilterSetHandle_as_sequence = {
+    (lenfunc) NetfilterSetHandle_len,          /* sq_length */
+};
+
 static PyTypeObject NetfilterSetHandleType = {
     PyVarObject_HEAD_INIT(NULL, 0)
     "libnftnlset.NetfilterSetHandle",          /* tp_name */
@@ -474,7 +1093,7 @@ static PyTypeObject NetfilterSetHandleType = {
     0,                                         /* tp_compare */
     0,                                         /* tp_repr */
     0,                                         /* tp_as_number */
-    0,                                         /* tp_as_sequence */
+    &NetfilterSetHandle_as_sequence,           /* tp_as_sequence */
     0,                                         /* tp_as_mapping */
     0,                                         /* tp_hash */
     0,                                         /* tp_call */
@@ -482,13 +1101,14 @@ static PyTypeObject NetfilterSetHandleType = {
     (getattrofunc) NetfilterSetHandle_GetAttr, /* tp_getattro */
     (setattrofunc) NetfilterSetHandle_SetAttr, /* tp_setattro */
     0,                                         /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,  /* tp_flags */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE |
+        Py_TPFLAGS_HAVE_GC,                    /* tp_flags */
     "Wrapper for (struct nftnl_set *)",        /* tp_doc */
-    0,                                         /* tp_traverse */
-    0,                                         /* tp_clear */
+    (traverseproc) NetfilterSetHandle_traverse, /* tp_traverse */
+    (inquiry) NetfilterSetHandle_clear_refs,   /* tp_clear */
     0,                                         /* tp_richcompare */
     0,                                         /* tp_weaklistoffset */
-    0,                                         /* tp_iter */
+    (getiterfunc) NetfilterSetHandle_iter,     /* tp_iter */
     0,                                         /* tp_iternext */
     NetfilterSetHandle_methods,                /* tp_methods */
     NetfilterSetHandle_members,                /* tp_members */
@@ -505,233 +1125,4145 @@ static PyTypeObject NetfilterSetHandleType = {
 
 // END: NetfilterSetHandle
 
-// BEGIN: NetfilterBatchHandle
+// BEGIN: NetfilterStoreHandle
 
+/* Elements kept as fixed-stride records in a single arena instead of one
+   nftnl_set_elem each. A record is laid out as
+       [uint64_t timeout][key, padded to 4][data, padded to 4]
+   rounded up to 8 bytes. Keys of concatenated sets are given field by field
+   and every field is padded to a 32-bit register on insertion, the way
+   nftables lays them out. */
 typedef struct {
     PyObject_HEAD
-    uint32_t seq; char* buffer;
-    struct mnl_nlmsg_batch *handle;
-} NetfilterBatchHandle;
-
-static PyObject* NetfilterBatchHandle_new (PyTypeObject* type, PyTupleObject* args) {
-    NetfilterBatchHandle* self;
-    self = (NetfilterBatchHandle*) type->tp_alloc(type, 0);
-    self->handle = NULL;
-    self->buffer = NULL;
+    uint32_t key_len; uint32_t data_len;
+    uint32_t key_stride; uint32_t data_stride;
+    uint32_t stride; uint32_t input_len;
+    uint8_t fields[NFT_REG32_COUNT]; uint32_t field_count;
+    char* arena; size_t count; size_t cap;
+} NetfilterStoreHandle;
+
+static PyObject* NetfilterStoreHandle_new (PyTypeObject* type, PyTupleObject* args) {
+    NetfilterStoreHandle* self;
+    self = (NetfilterStoreHandle*) type->tp_alloc(type, 0);
+    self->key_len = 0;
+    self->data_len = 0;
+    self->key_stride = 0;
+    self->data_stride = 0;
+    self->stride = sizeof(uint64_t);
+    self->input_len = 0;
+    self->field_count = 0;
+    self->arena = NULL;
+    self->count = 0;
+    self->cap = 0;
     return (PyObject*) self;
 }
 
-static int NetfilterBatchHandle_init (NetfilterBatchHandle* self, PyTupleObject* args) {
+static int NetfilterStoreHandle_init (NetfilterStoreHandle* self, PyTupleObject* args) {
     return 0;
 }
 
-static void NetfilterBatchHandle_dealloc (NetfilterBatchHandle* self) {
-    if (self->handle) mnl_nlmsg_batch_stop(self->handle);
-    if (self->buffer) free(self->buffer);
+static void NetfilterStoreHandle_dealloc (NetfilterStoreHandle* self) {
+    free(self->arena);
     Py_TYPE(self)->tp_free((PyObject*) self);
 }
 
-static PyObject* NetfilterBatchHandle_begin (NetfilterBatchHandle* self, PyTupleObject* args) {
-    uint32_t bufsize;
+static int _NetfilterStoreHandle_reserve (NetfilterStoreHandle* self, size_t count) {
+    size_t cap; char* arena;
 
-    if (!PyArg_ParseTuple((PyObject*) args, "I", &bufsize)) {
-        PyErr_SetString(PyExc_ValueError, "Parameters must be (uint32_t bufsize)");
-        return NULL;
-    }
+    if (self->count + count <= self->cap)
+        return 0;
 
-    if (self->handle || self->buffer) {
-        PyErr_SetString(PyExc_OSError, "NetfilterBatchHandle.begin has already been called");
-        return NULL;
+    cap = self->cap ? self->cap : 1024;
+    while (cap < self->count + count)
+        cap *= 2;
+    arena = realloc(self->arena, cap * self->stride);
+    if (!arena) {
+        PyErr_SetString(PyExc_OSError, "Call to realloc failed");
+        return -1;
     }
 
-    self->seq = time(NULL);
+    self->arena = arena;
+    self->cap = cap;
+    return 0;
+}
 
-    self->buffer = malloc(bufsize);
-    if (!self->buffer) {
-        PyErr_SetString(PyExc_OSError, "Call to malloc failed");
-        return NULL;
+/* Appends one record. `key` holds input_len bytes, `data` data_len bytes */
+static void _NetfilterStoreHandle_append (NetfilterStoreHandle* self, const char* key,
+                                          const char* data, uint64_t timeout) {
+    char* record = self->arena + self->count * self->stride;
+    char* dst; uint32_t i;
+
+    memset(record, 0, self->stride);
+    memcpy(record, &timeout, sizeof(uint64_t));
+
+    dst = record + sizeof(uint64_t);
+    if (self->field_count) {
+        for (i = 0; i < self->field_count; i++) {
+            memcpy(dst, key, self->fields[i]);
+            key += self->fields[i];
+            dst += MNL_ALIGN(self->fields[i]);
+        }
+    } else {
+        memcpy(dst, key, self->key_len);
     }
 
-    self->handle = mnl_nlmsg_batch_start(self->buffer, bufsize);
-    if (!self->handle) {
-        PyErr_SetString(PyExc_OSError, "Call to mnl_nlmsg_batch_start failed");
-        return NULL;
-    }
+    if (data)
+        memcpy(record + sizeof(uint64_t) + self->key_stride, data, self->data_len);
 
-    nftnl_batch_begin(mnl_nlmsg_batch_current(self->handle), self->seq++);
-    mnl_nlmsg_batch_next(self->handle);
-    return PyInt_FromLong(self->seq);
+    self->count++;
 }
 
-static PyObject* NetfilterBatchHandle_set_put (NetfilterBatchHandle* self, PyTupleObject* args) {
-    struct nlmsghdr* msg;
-
-    NetfilterSetHandle* set;
-    uint16_t family; PyObject* ack;
-    uint16_t flags = NLM_F_CREATE | NLM_F_REPLACE;
+static char* _nf_nftnl_attr_hdr (char* dst, uint16_t type, uint16_t len) {
+    struct nlattr* attr = (struct nlattr*) dst;
+    attr->nla_type = type;
+    attr->nla_len = len;
+    return dst + MNL_ATTR_HDRLEN;
+}
 
-    if (!PyArg_ParseTuple((PyObject*) args, "OHO", &set, &family, &ack)) {
-        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, uint16_t family, bool ack)");
-        return NULL;
+/* Writes the element for one record at `dst` without going through
+   libnftnl, and returns its length. Keys of 4 bytes (ipv4_addr), 8 bytes
+   (ipv4_addr . inet_service and friends) and 16 bytes (ipv6_addr) are
+   copied with fixed-size moves. */
+static uint32_t _NetfilterStoreHandle_build_elem (NetfilterStoreHandle* self, char* dst,
+                                                  const char* record, uint32_t index, int keys_only) {
+    char* tail = dst + MNL_ATTR_HDRLEN;
+    const char* key = record + sizeof(uint64_t);
+    uint64_t timeout;
+
+    memcpy(&timeout, record, sizeof(uint64_t));
+    if (timeout && !keys_only) {
+        tail = _nf_nftnl_attr_hdr(tail, NFTA_SET_ELEM_TIMEOUT, MNL_ATTR_HDRLEN + sizeof(uint64_t));
+        timeout = htobe64(timeout);
+        memcpy(tail, &timeout, sizeof(uint64_t));
+        tail += sizeof(uint64_t);
     }
 
-    if (!PyObject_IsInstance((PyObject*) set, (PyObject*) &NetfilterSetHandleType)) {
-        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, uint16_t family, bool ack)");
-        return NULL;
+    tail = _nf_nftnl_attr_hdr(tail, NLA_F_NESTED | NFTA_SET_ELEM_KEY, 2 * MNL_ATTR_HDRLEN + self->key_stride);
+    tail = _nf_nftnl_attr_hdr(tail, NFTA_DATA_VALUE, MNL_ATTR_HDRLEN + self->key_len);
+    switch (self->key_stride) {
+        case 4:
+            memcpy(tail, key, 4);
+            break;
+        case 8:
+            memcpy(tail, key, 8);
+            break;
+        case 16:
+            memcpy(tail, key, 16);
+            break;
+        default:
+            memcpy(tail, key, self->key_stride);
     }
+    tail += self->key_stride;
 
-    if (!PyBool_Check(ack)) {
-        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, uint16_t family, bool ack)");
-        return NULL;
+    if (self->data_len && !keys_only) {
+        tail = _nf_nftnl_attr_hdr(tail, NLA_F_NESTED | NFTA_SET_ELEM_DATA, 2 * MNL_ATTR_HDRLEN + self->data_stride);
+        tail = _nf_nftnl_attr_hdr(tail, NFTA_DATA_VALUE, MNL_ATTR_HDRLEN + self->data_len);
+        memcpy(tail, key + self->key_stride, self->data_stride);
+        tail += self->data_stride;
     }
 
-    flags |= ((PyObject_IsTrue(ack)) ? (NLM_F_ACK) : (0));
+    _nf_nftnl_attr_hdr(dst, NLA_F_NESTED | index, (uint16_t) (tail - dst));
+    return (uint32_t) (tail - dst);
+}
 
-    msg = nftnl_set_nlmsg_build_hdr(mnl_nlmsg_batch_current(self->handle),
-                                    NFT_MSG_NEWSET, family, flags,
-                                    self->seq++);
-    nftnl_set_nlmsg_build_payload(msg, set->handle);
-    mnl_nlmsg_batch_next(self->handle);
+/* Fills the NFTA_SET_ELEM_LIST_ELEMENTS of a message with records from
+   [start, stop), and returns the first record that did not fit */
+static size_t _NetfilterStoreHandle_build_elems (NetfilterStoreHandle* self, struct nlmsghdr* msg,
+                                                 size_t start, size_t stop, int keys_only) {
+    struct nlattr* nest; uint32_t index; uint32_t len;
+
+    nest = mnl_attr_nest_start(msg, NFTA_SET_ELEM_LIST_ELEMENTS);
+    for (index = 1; start < stop; start++, index++) {
+        /* An element past the chunk is left beyond the tail, in the slack
+           every batch page has, and simply not accounted for */
+        len = _NetfilterStoreHandle_build_elem(self, mnl_nlmsg_get_payload_tail(msg),
+                                               self->arena + start * self->stride,
+                                               index, keys_only);
+        if (msg->nlmsg_len + len > NF_NFTNL_MSG_CHUNK && index > 1)
+            break;
+        msg->nlmsg_len += len;
+    }
+    mnl_attr_nest_end(msg, nest);
 
-    return PyInt_FromLong(self->seq);
+    return start;
 }
 
-static PyObject* NetfilterBatchHandle_set_del (NetfilterBatchHandle* self, PyTupleObject* args) {
-    struct nlmsghdr* msg;
-
-    NetfilterSetHandle* set;
-    uint16_t family; PyObject* ack;
-    uint16_t flags = 0;
+static PyObject* NetfilterStoreHandle_add (NetfilterStoreHandle* self, PyTupleObject* args) {
+    const char* key; int key_len;
+    const char* data = NULL; int data_len = 0;
+    unsigned PY_LONG_LONG timeout = 0;
 
-    if (!PyArg_ParseTuple((PyObject*) args, "OHO", &set, &family, &ack)) {
-        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, uint16_t family, bool ack)");
+    if (!PyArg_ParseTuple((PyObject*) args, "s#|z#K", &key, &key_len, &data, &data_len, &timeout)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (bytes key, bytes data=None, uint64_t timeout=0)");
         return NULL;
     }
 
-    if (!PyObject_IsInstance((PyObject*) set, (PyObject*) &NetfilterSetHandleType)) {
-        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, uint16_t family, bool ack)");
+    if ((uint32_t) key_len != self->input_len) {
+        PyErr_SetString(PyExc_ValueError, "Key does not match the store key length");
         return NULL;
     }
 
-    if (!PyBool_Check(ack)) {
-        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, uint16_t family, bool ack)");
+    if (self->data_len ? (!data || (uint32_t) data_len != self->data_len) : data && data_len) {
+        PyErr_SetString(PyExc_ValueError, "Data does not match the store data_len");
         return NULL;
     }
 
-    flags |= ((PyObject_IsTrue(ack)) ? (NLM_F_ACK) : (0));
-
-    msg = nftnl_set_nlmsg_build_hdr(mnl_nlmsg_batch_current(self->handle),
-                                    NFT_MSG_DELSET, family, flags,
-                                    self->seq++);
-    nftnl_set_nlmsg_build_payload(msg, set->handle);
-    mnl_nlmsg_batch_next(self->handle);
+    if (_NetfilterStoreHandle_reserve(self, 1) < 0)
+        return NULL;
+    _NetfilterStoreHandle_append(self, key, data, timeout);
 
-    return PyInt_FromLong(self->seq);
+    Py_RETURN_NONE;
 }
 
-static PyObject* NetfilterBatchHandle_elem_put (NetfilterBatchHandle* self, PyTupleObject* args) {
-    struct nlmsghdr* msg;
-
-    NetfilterSetHandle* set;
-    uint16_t family; PyObject* ack;
-    uint16_t flags = NLM_F_CREATE | NLM_F_REPLACE;
+static PyObject* NetfilterStoreHandle_extend (NetfilterStoreHandle* self, PyTupleObject* args) {
+    const char* keys; int keys_len;
+    const char* data = NULL; int data_len = 0;
+    unsigned PY_LONG_LONG timeout = 0;
+    size_t count; size_t i;
 
-    if (!PyArg_ParseTuple((PyObject*) args, "OHO", &set, &family, &ack)) {
-        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, uint16_t family, bool ack)");
+    if (!PyArg_ParseTuple((PyObject*) args, "s#|z#K", &keys, &keys_len, &data, &data_len, &timeout)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (bytes keys, bytes data=None, uint64_t timeout=0)");
         return NULL;
     }
 
-    if (!PyObject_IsInstance((PyObject*) set, (PyObject*) &NetfilterSetHandleType)) {
-        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, uint16_t family, bool ack)");
+    if (keys_len % self->input_len) {
+        PyErr_SetString(PyExc_ValueError, "Key buffer must be a multiple of the store key length");
         return NULL;
     }
+    count = keys_len / self->input_len;
 
-    if (!PyBool_Check(ack)) {
-        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, uint16_t family, bool ack)");
+    if (self->data_len ? (!data || (size_t) data_len != count * self->data_len) : data && data_len) {
+        PyErr_SetString(PyExc_ValueError, "Data buffer must hold data_len bytes per key");
         return NULL;
     }
 
-    flags |= ((PyObject_IsTrue(ack)) ? (NLM_F_ACK) : (0));
+    if (_NetfilterStoreHandle_reserve(self, count) < 0)
+        return NULL;
+    for (i = 0; i < count; i++)
+        _NetfilterStoreHandle_append(self, keys + i * self->input_len,
+                                     data ? data + i * self->data_len : NULL, timeout);
+
+    Py_RETURN_NONE;
+}
+
+static PyObject* NetfilterStoreHandle_clear (NetfilterStoreHandle* self) {
+    self->count = 0;
+    Py_RETURN_NONE;
+}
+
+static Py_ssize_t NetfilterStoreHandle_len (NetfilterStoreHandle* self) {
+    return (Py_ssize_t) self->count;
+}
+
+static PyObject* NetfilterStoreHandle_get_key_len (NetfilterStoreHandle* self, void* closure) {
+    return PyInt_FromLong((long) self->key_len);
+}
+
+static PyObject* NetfilterStoreHandle_get_data_len (NetfilterStoreHandle* self, void* closure) {
+    return PyInt_FromLong((long) self->data_len);
+}
+
+static PyMemberDef NetfilterStoreHandle_members[] = {
+    {NULL}
+};
+
+static PyGetSetDef NetfilterStoreHandle_getset[] = {
+    {"key_len", (getter) NetfilterStoreHandle_get_key_len, NULL, NULL, NULL},
+    {"data_len", (getter) NetfilterStoreHandle_get_data_len, NULL, NULL, NULL},
+    {NULL}
+};
+
+static PyMethodDef NetfilterStoreHandle_methods[] = {
+    {"add", (PyCFunction) NetfilterStoreHandle_add, METH_VARARGS, NULL},
+    {"extend", (PyCFunction) NetfilterStoreHandle_extend, METH_VARARGS, NULL},
+    {"clear", (PyCFunction) NetfilterStoreHandle_clear, METH_NOARGS, NULL},
+    {NULL}
+};
+
+static PySequenceMethods NetfilterStoreHandle_as_sequence = {
+    (lenfunc) NetfilterStoreHandle_len,            /* sq_length */
+};
+
+static PyTypeObject NetfilterStoreHandleType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "libnftnlset.NetfilterStoreHandle",            /* tp_name */
+    sizeof(NetfilterStoreHandle),                  /* tp_basicsize */
+    0,                                             /* tp_itemsize */
+    (destructor) NetfilterStoreHandle_dealloc,     /* tp_dealloc */
+    0,                                             /* tp_print */
+    0,                                             /* tp_getattr */
+    0,                                             /* tp_setattr */
+    0,                                             /* tp_compare */
+    0,                                             /* tp_repr */
+    0,                                             /* tp_as_number */
+    &NetfilterStoreHandle_as_sequence,             /* tp_as_sequence */
+    0,                                             /* tp_as_mapping */
+    0,                                             /* tp_hash */
+    0,                                             /* tp_call */
+    0,                                             /* tp_str */
+    0,                                             /* tp_getattro */
+    0,                                             /* tp_setattro */
+    0,                                             /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,      /* tp_flags */
+    "Arena of fixed-stride set elements",          /* tp_doc */
+    0,                                             /* tp_traverse */
+    0,                                             /* tp_clear */
+    0,                                             /* tp_richcompare */
+    0,                                             /* tp_weaklistoffset */
+    0,                                             /* tp_iter */
+    0,                                             /* tp_iternext */
+    NetfilterStoreHandle_methods,                  /* tp_methods */
+    NetfilterStoreHandle_members,                  /* tp_members */
+    NetfilterStoreHandle_getset,                   /* tp_getset */
+    0,                                             /* tp_base */
+    0,                                             /* tp_dict */
+    0,                                             /* tp_descr_get */
+    0,                                             /* tp_descr_set */
+    0,                                             /* tp_dictoffset */
+    (initproc) NetfilterStoreHandle_init,          /* tp_init */
+    0,                                             /* tp_alloc */
+    (newfunc) NetfilterStoreHandle_new,            /* tp_new */
+};
+
+// END: NetfilterStoreHandle
+
+// BEGIN: NetfilterBatchHandle
+
+typedef struct {
+    PyObject_HEAD
+    uint32_t seq; char* buffer; uint32_t limit;
+    struct mnl_nlmsg_batch *handle;
+    char* pages; size_t pages_len; size_t pages_cap;
+} NetfilterBatchHandle;
+
+static PyObject* NetfilterBatchHandle_new (PyTypeObject* type, PyTupleObject* args) {
+    NetfilterBatchHandle* self;
+    self = (NetfilterBatchHandle*) type->tp_alloc(type, 0);
+    self->handle = NULL;
+    self->buffer = NULL;
+    self->pages = NULL;
+    self->pages_len = 0;
+    self->pages_cap = 0;
+    return (PyObject*) self;
+}
+
+static int NetfilterBatchHandle_init (NetfilterBatchHandle* self, PyTupleObject* args) {
+    return 0;
+}
+
+static void NetfilterBatchHandle_dealloc (NetfilterBatchHandle* self) {
+    if (self->handle) mnl_nlmsg_batch_stop(self->handle);
+    if (self->buffer) free(self->buffer);
+    if (self->pages) free(self->pages);
+    Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+static int _NetfilterBatchHandle_page (NetfilterBatchHandle* self, const void* data, size_t size) {
+    size_t cap; char* pages;
+
+    if (self->pages_len + size > self->pages_cap) {
+        cap = self->pages_cap ? self->pages_cap : NF_NFTNL_BATCH_OVERRUN;
+        while (cap < self->pages_len + size)
+            cap *= 2;
+        pages = realloc(self->pages, cap);
+        if (!pages) {
+            PyErr_SetString(PyExc_OSError, "Call to realloc failed");
+            return -1;
+        }
+        self->pages = pages;
+        self->pages_cap = cap;
+    }
+
+    memcpy(self->pages + self->pages_len, data, size);
+    self->pages_len += size;
+    return 0;
+}
+
+/* Moves on to the next message. Once the current page is full, it is set
+   aside and the message that overflowed it starts a fresh page. This is
+   done by hand since mnl_nlmsg_batch_reset copies the overflowed message
+   with an overlapping memcpy. */
+static int _NetfilterBatchHandle_next (NetfilterBatchHandle* self) {
+    struct nlmsghdr* msg; uint32_t msglen;
+
+    if (mnl_nlmsg_batch_next(self->handle))
+        return 0;
+
+    msg = mnl_nlmsg_batch_current(self->handle);
+    msglen = msg->nlmsg_len;
+    if (_NetfilterBatchHandle_page(self, mnl_nlmsg_batch_head(self->handle),
+                                   mnl_nlmsg_batch_size(self->handle)) < 0)
+        return -1;
+
+    if (msglen > self->limit) {
+        if (_NetfilterBatchHandle_page(self, msg, msglen) < 0)
+            return -1;
+        msglen = 0;
+    } else {
+        memmove(self->buffer, msg, msglen);
+    }
+
+    mnl_nlmsg_batch_stop(self->handle);
+    self->handle = mnl_nlmsg_batch_start(self->buffer, self->limit);
+    if (!self->handle) {
+        PyErr_SetString(PyExc_OSError, "Call to mnl_nlmsg_batch_start failed");
+        return -1;
+    }
+
+    if (msglen)
+        mnl_nlmsg_batch_next(self->handle);
+    return 0;
+}
+
+/* Sets the current page aside, even if it is not full yet */
+static int _NetfilterBatchHandle_flush (NetfilterBatchHandle* self) {
+    if (_NetfilterBatchHandle_page(self, mnl_nlmsg_batch_head(self->handle),
+                                   mnl_nlmsg_batch_size(self->handle)) < 0)
+        return -1;
+
+    mnl_nlmsg_batch_stop(self->handle);
+    self->handle = mnl_nlmsg_batch_start(self->buffer, self->limit);
+    if (!self->handle) {
+        PyErr_SetString(PyExc_OSError, "Call to mnl_nlmsg_batch_start failed");
+        return -1;
+    }
+    return 0;
+}
+
+static int _NetfilterBatchHandle_elems (NetfilterBatchHandle* self, NetfilterSetHandle* set,
+                                        uint16_t type, uint16_t family, uint16_t flags) {
+    struct nlmsghdr* msg;
+    Py_ssize_t start = 0;
+
+    /* An empty DELSETELEM would flush the whole set, an empty NEWSETELEM is
+       rejected: an empty set handle adds no message at all */
+    while (start < PyList_GET_SIZE(set->elements)) {
+        msg = nftnl_nlmsg_build_hdr(mnl_nlmsg_batch_current(self->handle),
+                                    type, family, flags, self->seq++);
+        start = _NetfilterSetHandle_build_elems(set, msg, start);
+        if (_NetfilterBatchHandle_next(self) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Encodes elements (or packed keys) on up to `workers` threads with the GIL
+   released, then copies the resulting messages into the batch in order,
+   numbering them as if they had been built one after the other. */
+static int _NetfilterBatchHandle_parallel (NetfilterBatchHandle* self, NetfilterSetHandle* set,
+                                           PyObject* keys, uint16_t type, uint16_t family,
+                                           uint16_t flags, uint32_t workers) {
+    _nf_nftnl_shard* shards; struct nftnl_set_elem** elems = NULL;
+    PyObject* snapshot = NULL; struct nlmsghdr* msg;
+    size_t count; size_t offset; uint32_t key_len = 0;
+    uint32_t i; int error; int result = -1;
+    const char* call = NULL; char message[64]; PyObject* exception;
+
+    if (keys) {
+        key_len = nftnl_set_get_u32(set->handle, NFTNL_SET_KEY_LEN);
+        if (!key_len || PyString_GET_SIZE(keys) % key_len) {
+            PyErr_SetString(PyExc_ValueError, "Key buffer must be a multiple of the set key_len");
+            return -1;
+        }
+        count = PyString_GET_SIZE(keys) / key_len;
+    } else {
+        /* The snapshot keeps every element alive while the GIL is released */
+        snapshot = PyList_GetSlice(set->elements, 0, PyList_GET_SIZE(set->elements));
+        if (!snapshot)
+            return -1;
+        count = PyList_GET_SIZE(snapshot);
+        elems = malloc(sizeof(struct nftnl_set_elem*) * (count ? count : 1));
+        if (!elems) {
+            PyErr_SetString(PyExc_OSError, "Call to malloc failed");
+            Py_DECREF(snapshot);
+            return -1;
+        }
+        for (offset = 0; offset < count; offset++)
+            elems[offset] = ((NetfilterElementHandle*) PyList_GET_ITEM(snapshot, offset))->handle;
+    }
+
+    if (workers < 1)
+        workers = 1;
+    if (workers > count)
+        workers = count ? count : 1;
+
+    shards = calloc(workers, sizeof(_nf_nftnl_shard));
+    if (!shards) {
+        PyErr_SetString(PyExc_OSError, "Call to calloc failed");
+        goto cleanup;
+    }
+
+    for (i = 0; i < workers; i++) {
+        shards[i].type = type;
+        shards[i].family = family;
+        shards[i].flags = flags;
+        shards[i].set = set->handle;
+        shards[i].elems = elems;
+        shards[i].keys = keys ? PyString_AS_STRING(keys) : NULL;
+        shards[i].key_len = key_len;
+    }
+
+    /* The workers read the set and its elements without the GIL, so both
+       refuse to be modified from other threads until they are done */
+    set->busy++;
+    for (offset = 0; snapshot && offset < count; offset++)
+        ((NetfilterElementHandle*) PyList_GET_ITEM(snapshot, offset))->busy++;
+
+    Py_BEGIN_ALLOW_THREADS
+    error = _nf_nftnl_shard_run(shards, workers, count, &call);
+    Py_END_ALLOW_THREADS
+
+    set->busy--;
+    for (offset = 0; snapshot && offset < count; offset++)
+        ((NetfilterElementHandle*) PyList_GET_ITEM(snapshot, offset))->busy--;
+
+    if (error) {
+        snprintf(message, sizeof(message), "Call to %s failed", call);
+        exception = Py_BuildValue("(is)", error, message);
+        if (exception) {
+            PyErr_SetObject(PyExc_OSError, exception);
+            Py_DECREF(exception);
+        }
+        goto cleanup;
+    }
+
+    if (_NetfilterBatchHandle_flush(self) < 0)
+        goto cleanup;
+
+    for (i = 0; i < workers; i++) {
+        for (offset = 0; offset < shards[i].len; offset += MNL_ALIGN(msg->nlmsg_len)) {
+            msg = (struct nlmsghdr*) (shards[i].buffer + offset);
+            msg->nlmsg_seq = self->seq++;
+        }
+        if (_NetfilterBatchHandle_page(self, shards[i].buffer, shards[i].len) < 0)
+            goto cleanup;
+    }
+
+    result = 0;
+
+cleanup:
+    if (shards) {
+        for (i = 0; i < workers; i++)
+            free(shards[i].buffer);
+        free(shards);
+    }
+    free(elems);
+    Py_XDECREF(snapshot);
+    return result;
+}
+
+static int _NetfilterBatchHandle_store (NetfilterBatchHandle* self, NetfilterSetHandle* set,
+                                        NetfilterStoreHandle* store, size_t start, size_t stop,
+                                        uint16_t type, uint16_t family, uint16_t flags, int keys_only) {
+    struct nlmsghdr* msg;
+
+    if (nftnl_set_is_set(set->handle, NFTNL_SET_KEY_LEN) &&
+        nftnl_set_get_u32(set->handle, NFTNL_SET_KEY_LEN) != store->key_len) {
+        PyErr_SetString(PyExc_ValueError, "Store key_len does not match the set key_len");
+        return -1;
+    }
+
+    while (start < stop) {
+        msg = nftnl_nlmsg_build_hdr(mnl_nlmsg_batch_current(self->handle),
+                                    type, family, flags, self->seq++);
+        _nf_nftnl_set_elem_build_def(msg, set->handle);
+        start = _NetfilterStoreHandle_build_elems(store, msg, start, stop, keys_only);
+        if (_NetfilterBatchHandle_next(self) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static PyObject* NetfilterBatchHandle_begin (NetfilterBatchHandle* self, PyTupleObject* args) {
+    uint32_t bufsize;
+
+    if (!PyArg_ParseTuple((PyObject*) args, "I", &bufsize)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (uint32_t bufsize)");
+        return NULL;
+    }
+
+    if (self->handle || self->buffer) {
+        PyErr_SetString(PyExc_OSError, "NetfilterBatchHandle.begin has already been called");
+        return NULL;
+    }
+
+    self->seq = time(NULL);
+
+    self->limit = bufsize;
+    self->buffer = malloc(bufsize + NF_NFTNL_BATCH_OVERRUN);
+    if (!self->buffer) {
+        PyErr_SetString(PyExc_OSError, "Call to malloc failed");
+        return NULL;
+    }
+
+    self->handle = mnl_nlmsg_batch_start(self->buffer, bufsize);
+    if (!self->handle) {
+        PyErr_SetString(PyExc_OSError, "Call to mnl_nlmsg_batch_start failed");
+        return NULL;
+    }
+
+    nftnl_batch_begin(mnl_nlmsg_batch_current(self->handle), self->seq++);
+    if (_NetfilterBatchHandle_next(self) < 0)
+        return NULL;
+    return PyInt_FromLong(self->seq);
+}
+
+static PyObject* NetfilterBatchHandle_set_put (NetfilterBatchHandle* self, PyTupleObject* args) {
+    struct nlmsghdr* msg;
+
+    NetfilterSetHandle* set;
+    uint16_t family; PyObject* ack;
+    uint16_t flags = NLM_F_CREATE | NLM_F_REPLACE;
+
+    if (!PyArg_ParseTuple((PyObject*) args, "OHO", &set, &family, &ack)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, uint16_t family, bool ack)");
+        return NULL;
+    }
+
+    if (!PyObject_IsInstance((PyObject*) set, (PyObject*) &NetfilterSetHandleType)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, uint16_t family, bool ack)");
+        return NULL;
+    }
+
+    if (!PyBool_Check(ack)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, uint16_t family, bool ack)");
+        return NULL;
+    }
+
+    flags |= ((PyObject_IsTrue(ack)) ? (NLM_F_ACK) : (0));
+
+    msg = nftnl_set_nlmsg_build_hdr(mnl_nlmsg_batch_current(self->handle),
+                                    NFT_MSG_NEWSET, family, flags,
+                                    self->seq++);
+    nftnl_set_nlmsg_build_payload(msg, set->handle);
+    if (_NetfilterBatchHandle_next(self) < 0)
+        return NULL;
+
+    return PyInt_FromLong(self->seq);
+}
+
+static PyObject* NetfilterBatchHandle_set_del (NetfilterBatchHandle* self, PyTupleObject* args) {
+    struct nlmsghdr* msg;
+
+    NetfilterSetHandle* set;
+    uint16_t family; PyObject* ack;
+    uint16_t flags = 0;
+
+    if (!PyArg_ParseTuple((PyObject*) args, "OHO", &set, &family, &ack)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, uint16_t family, bool ack)");
+        return NULL;
+    }
+
+    if (!PyObject_IsInstance((PyObject*) set, (PyObject*) &NetfilterSetHandleType)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, uint16_t family, bool ack)");
+        return NULL;
+    }
+
+    if (!PyBool_Check(ack)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, uint16_t family, bool ack)");
+        return NULL;
+    }
+
+    flags |= ((PyObject_IsTrue(ack)) ? (NLM_F_ACK) : (0));
+
+    msg = nftnl_set_nlmsg_build_hdr(mnl_nlmsg_batch_current(self->handle),
+                                    NFT_MSG_DELSET, family, flags,
+                                    self->seq++);
+    nftnl_set_nlmsg_build_payload(msg, set->handle);
+    if (_NetfilterBatchHandle_next(self) < 0)
+        return NULL;
+
+    return PyInt_FromLong(self->seq);
+}
+
+static PyObject* NetfilterBatchHandle_elem_put (NetfilterBatchHandle* self, PyTupleObject* args) {
+    NetfilterSetHandle* set;
+    uint16_t family; PyObject* ack;
+    uint16_t flags = NLM_F_CREATE | NLM_F_REPLACE;
+
+    if (!PyArg_ParseTuple((PyObject*) args, "OHO", &set, &family, &ack)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, uint16_t family, bool ack)");
+        return NULL;
+    }
+
+    if (!PyObject_IsInstance((PyObject*) set, (PyObject*) &NetfilterSetHandleType)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, uint16_t family, bool ack)");
+        return NULL;
+    }
+
+    if (!PyBool_Check(ack)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, uint16_t family, bool ack)");
+        return NULL;
+    }
+
+    flags |= ((PyObject_IsTrue(ack)) ? (NLM_F_ACK) : (0));
+
+    if (_NetfilterBatchHandle_elems(self, set, NFT_MSG_NEWSETELEM, family, flags) < 0)
+        return NULL;
+
+    return PyInt_FromLong(self->seq);
+}
+
+static PyObject* NetfilterBatchHandle_elem_del (NetfilterBatchHandle* self, PyTupleObject* args) {
+    NetfilterSetHandle* set;
+    uint16_t family; PyObject* ack;
+    uint16_t flags = 0;
+
+    if (!PyArg_ParseTuple((PyObject*) args, "OHO", &set, &family, &ack)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, uint16_t family, bool ack)");
+        return NULL;
+    }
+
+    if (!PyObject_IsInstance((PyObject*) set, (PyObject*) &NetfilterSetHandleType)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, uint16_t family, bool ack)");
+        return NULL;
+    }
+
+    if (!PyBool_Check(ack)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, uint16_t family, bool ack)");
+        return NULL;
+    }
+
+    flags |= ((PyObject_IsTrue(ack)) ? (NLM_F_ACK) : (0));
+
+    if (_NetfilterBatchHandle_elems(self, set, NFT_MSG_DELSETELEM, family, flags) < 0)
+        return NULL;
+
+    return PyInt_FromLong(self->seq);
+}
+
+static PyObject* _NetfilterBatchHandle_elem_parallel (NetfilterBatchHandle* self, PyTupleObject* args,
+                                                      uint16_t type, uint16_t flags) {
+    NetfilterSetHandle* set;
+    uint16_t family; PyObject* ack; uint32_t workers;
+
+    if (!PyArg_ParseTuple((PyObject*) args, "OHOI", &set, &family, &ack, &workers)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, uint16_t family, bool ack, uint32_t workers)");
+        return NULL;
+    }
+
+    if (!PyObject_IsInstance((PyObject*) set, (PyObject*) &NetfilterSetHandleType)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, uint16_t family, bool ack, uint32_t workers)");
+        return NULL;
+    }
+
+    if (!PyBool_Check(ack)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, uint16_t family, bool ack, uint32_t workers)");
+        return NULL;
+    }
+
+    flags |= ((PyObject_IsTrue(ack)) ? (NLM_F_ACK) : (0));
+
+    if (_NetfilterBatchHandle_parallel(self, set, NULL, type, family, flags, workers) < 0)
+        return NULL;
+
+    return PyInt_FromLong(self->seq);
+}
+
+static PyObject* NetfilterBatchHandle_elem_put_parallel (NetfilterBatchHandle* self, PyTupleObject* args) {
+    return _NetfilterBatchHandle_elem_parallel(self, args, NFT_MSG_NEWSETELEM, NLM_F_CREATE | NLM_F_REPLACE);
+}
+
+static PyObject* NetfilterBatchHandle_elem_del_parallel (NetfilterBatchHandle* self, PyTupleObject* args) {
+    return _NetfilterBatchHandle_elem_parallel(self, args, NFT_MSG_DELSETELEM, 0);
+}
+
+static PyObject* _NetfilterBatchHandle_keys_parallel (NetfilterBatchHandle* self, PyTupleObject* args,
+                                                      uint16_t type, uint16_t flags) {
+    NetfilterSetHandle* set; PyObject* keys;
+    uint16_t family; PyObject* ack; uint32_t workers;
+
+    if (!PyArg_ParseTuple((PyObject*) args, "OSHOI", &set, &keys, &family, &ack, &workers)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, bytes keys, uint16_t family, bool ack, uint32_t workers)");
+        return NULL;
+    }
+
+    if (!PyObject_IsInstance((PyObject*) set, (PyObject*) &NetfilterSetHandleType)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, bytes keys, uint16_t family, bool ack, uint32_t workers)");
+        return NULL;
+    }
+
+    if (!PyBool_Check(ack)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, bytes keys, uint16_t family, bool ack, uint32_t workers)");
+        return NULL;
+    }
+
+    flags |= ((PyObject_IsTrue(ack)) ? (NLM_F_ACK) : (0));
+
+    if (_NetfilterBatchHandle_parallel(self, set, keys, type, family, flags, workers) < 0)
+        return NULL;
+
+    return PyInt_FromLong(self->seq);
+}
+
+static PyObject* NetfilterBatchHandle_keys_put (NetfilterBatchHandle* self, PyTupleObject* args) {
+    return _NetfilterBatchHandle_keys_parallel(self, args, NFT_MSG_NEWSETELEM, NLM_F_CREATE | NLM_F_REPLACE);
+}
+
+static PyObject* NetfilterBatchHandle_keys_del (NetfilterBatchHandle* self, PyTupleObject* args) {
+    return _NetfilterBatchHandle_keys_parallel(self, args, NFT_MSG_DELSETELEM, 0);
+}
+
+static PyObject* _NetfilterBatchHandle_store_op (NetfilterBatchHandle* self, PyTupleObject* args,
+                                                 uint16_t type, uint16_t flags, int keys_only) {
+    NetfilterSetHandle* set; NetfilterStoreHandle* store;
+    uint16_t family; PyObject* ack;
+
+    if (!PyArg_ParseTuple((PyObject*) args, "OOHO", &set, &store, &family, &ack)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, NetfilterStoreHandle store, uint16_t family, bool ack)");
+        return NULL;
+    }
+
+    if (!PyObject_IsInstance((PyObject*) set, (PyObject*) &NetfilterSetHandleType)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, NetfilterStoreHandle store, uint16_t family, bool ack)");
+        return NULL;
+    }
+
+    if (!PyObject_IsInstance((PyObject*) store, (PyObject*) &NetfilterStoreHandleType)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, NetfilterStoreHandle store, uint16_t family, bool ack)");
+        return NULL;
+    }
+
+    if (!PyBool_Check(ack)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, NetfilterStoreHandle store, uint16_t family, bool ack)");
+        return NULL;
+    }
+
+    flags |= ((PyObject_IsTrue(ack)) ? (NLM_F_ACK) : (0));
+
+    if (_NetfilterBatchHandle_store(self, set, store, 0, store->count, type, family, flags, keys_only) < 0)
+        return NULL;
+
+    return PyInt_FromLong(self->seq);
+}
+
+static PyObject* NetfilterBatchHandle_store_put (NetfilterBatchHandle* self, PyTupleObject* args) {
+    return _NetfilterBatchHandle_store_op(self, args, NFT_MSG_NEWSETELEM, NLM_F_CREATE | NLM_F_REPLACE, 0);
+}
+
+static PyObject* NetfilterBatchHandle_store_del (NetfilterBatchHandle* self, PyTupleObject* args) {
+    return _NetfilterBatchHandle_store_op(self, args, NFT_MSG_DELSETELEM, 0, 1);
+}
+
+static PyObject* NetfilterBatchHandle_elem_flush (NetfilterBatchHandle* self, PyTupleObject* args) {
+    struct nlmsghdr* msg;
+
+    NetfilterSetHandle* set;
+    uint16_t family; PyObject* ack;
+    uint16_t flags = 0;
+
+    if (!PyArg_ParseTuple((PyObject*) args, "OHO", &set, &family, &ack)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, uint16_t family, bool ack)");
+        return NULL;
+    }
+
+    if (!PyObject_IsInstance((PyObject*) set, (PyObject*) &NetfilterSetHandleType)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, uint16_t family, bool ack)");
+        return NULL;
+    }
+
+    if (!PyBool_Check(ack)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, uint16_t family, bool ack)");
+        return NULL;
+    }
+
+    flags |= ((PyObject_IsTrue(ack)) ? (NLM_F_ACK) : (0));
+
+    /* A DELSETELEM without any elements flushes the whole set */
+    msg = nftnl_nlmsg_build_hdr(mnl_nlmsg_batch_current(self->handle),
+                                NFT_MSG_DELSETELEM, family, flags,
+                                self->seq++);
+    _nf_nftnl_set_elem_build_def(msg, set->handle);
+    if (_NetfilterBatchHandle_next(self) < 0)
+        return NULL;
+
+    return PyInt_FromLong(self->seq);
+}
+
+static PyObject* NetfilterBatchHandle_elem_replace (NetfilterBatchHandle* self, PyTupleObject* args) {
+    PyObject* result;
+
+    result = NetfilterBatchHandle_elem_flush(self, args);
+    if (!result)
+        return NULL;
+
+    /* The kernel rejects a NEWSETELEM without elements, which would abort
+       the whole transaction, so an empty set is just flushed */
+    if (!PyList_GET_SIZE(((NetfilterSetHandle*) PyTuple_GET_ITEM(args, 0))->elements))
+        return result;
+    Py_DECREF(result);
+
+    return NetfilterBatchHandle_elem_put(self, args);
+}
+
+static PyObject* NetfilterBatchHandle_end (NetfilterBatchHandle* self) {
+    if (!self->handle || !self->buffer) {
+        PyErr_SetString(PyExc_OSError, "NetfilterBatchHandle.begin must be called prior");
+        return NULL;
+    }
+
+    nftnl_batch_end(mnl_nlmsg_batch_current(self->handle), self->seq++);
+    if (_NetfilterBatchHandle_next(self) < 0)
+        return NULL;
+    return PyInt_FromLong(self->seq);
+}
+
+static PyObject* NetfilterBatchHandle_dump (NetfilterBatchHandle* self) {
+    PyObject* result; size_t size;
+
+    if (!self->pages_len)
+        return PyString_FromStringAndSize(mnl_nlmsg_batch_head(self->handle),
+                                          (Py_ssize_t) mnl_nlmsg_batch_size(self->handle));
+
+    size = mnl_nlmsg_batch_size(self->handle);
+    result = PyString_FromStringAndSize(NULL, (Py_ssize_t) (self->pages_len + size));
+    if (!result)
+        return NULL;
+
+    memcpy(PyString_AS_STRING(result), self->pages, self->pages_len);
+    memcpy(PyString_AS_STRING(result) + self->pages_len, mnl_nlmsg_batch_head(self->handle), size);
+    return result;
+}
+
+static PyMemberDef NetfilterBatchHandle_members[] = {
+    {NULL}
+};
+
+static PyMethodDef NetfilterBatchHandle_methods[] = {
+    {"begin", (PyCFunction) NetfilterBatchHandle_begin, METH_VARARGS, NULL},
+    {"set_put", (PyCFunction) NetfilterBatchHandle_set_put, METH_VARARGS, NULL},
+    {"set_del", (PyCFunction) NetfilterBatchHandle_set_del, METH_VARARGS, NULL},
+    {"elem_put", (PyCFunction) NetfilterBatchHandle_elem_put, METH_VARARGS, NULL},
+    {"elem_del", (PyCFunction) NetfilterBatchHandle_elem_del, METH_VARARGS, NULL},
+    {"elem_flush", (PyCFunction) NetfilterBatchHandle_elem_flush, METH_VARARGS, NULL},
+    {"elem_replace", (PyCFunction) NetfilterBatchHandle_elem_replace, METH_VARARGS, NULL},
+    {"elem_put_parallel", (PyCFunction) NetfilterBatchHandle_elem_put_parallel, METH_VARARGS, NULL},
+    {"elem_del_parallel", (PyCFunction) NetfilterBatchHandle_elem_del_parallel, METH_VARARGS, NULL},
+    {"keys_put", (PyCFunction) NetfilterBatchHandle_keys_put, METH_VARARGS, NULL},
+    {"keys_del", (PyCFunction) NetfilterBatchHandle_keys_del, METH_VARARGS, NULL},
+    {"store_put", (PyCFunction) NetfilterBatchHandle_store_put, METH_VARARGS, NULL},
+    {"store_del", (PyCFunction) NetfilterBatchHandle_store_del, METH_VARARGS, NULL},
+    {"end", (PyCFunction) NetfilterBatchHandle_end, METH_NOARGS, NULL},
+    {"dump", (PyCFunction) NetfilterBatchHandle_dump, METH_NOARGS, NULL},
+    {NULL}
+};
+
+static PyTypeObject NetfilterBatchHandleType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "libnftnlset.NetfilterBatchHandle",            /* tp_name */
+    sizeof(NetfilterBatchHandle),                  /* tp_basicsize */
+    0,                                             /* tp_itemsize */
+    (destructor) NetfilterBatchHandle_dealloc,     /* tp_dealloc */
+    0,                                             /* tp_print */
+    0,                                             /* tp_getattr */
+    0,                                             /* tp_setattr */
+    0,                                             /* tp_compare */
+    0,                                             /* tp_repr */
+    0,                                             /* tp_as_number */
+    0,                                             /* tp_as_sequence */
+    0,                                             /* tp_as_mapping */
+    0,                                             /* tp_hash */
+    0,                                             /* tp_call */
+    0,                                             /* tp_str */
+    0,                                             /* tp_getattro */
+    0,                                             /* tp_setattro */
+    0,                                             /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,      /* tp_flags */
+    "Wrapper for (struct mnl_nlmsg_batch *)",      /* tp_doc */
+    0,                                             /* tp_traverse */
+    0,                                             /* tp_clear */
+    0,                                             /* tp_richcompare */
+    0,                                             /* tp_weaklistoffset */
+    0,                                             /* tp_iter */
+    0,                                             /* tp_iternext */
+    NetfilterBatchHandle_methods,                  /* tp_methods */
+    NetfilterBatchHandle_members,                  /* tp_members */
+    0,                                             /* tp_getset */
+    0,                                             /* tp_base */
+    0,                                             /* tp_dict */
+    0,                                             /* tp_descr_get */
+    0,                                             /* tp_descr_set */
+    0,                                             /* tp_dictoffset */
+    (initproc) NetfilterBatchHandle_init,          /* tp_init */
+    0,                                             /* tp_alloc */
+    (newfunc) NetfilterBatchHandle_new,            /* tp_new */
+};
+
+// END: NetfilterBatchHandle
+
+// BEGIN: NetfilterSocketHandle
+
+/* A serialized batch waiting to be sent or acknowledged. `first` identifies
+   the batch, `last` is the last message the kernel is expected to answer. */
+typedef struct _nf_nftnl_pending {
+    struct _nf_nftnl_pending* next;
+    char* data; size_t len;
+    uint32_t first; uint32_t last;
+    int sent; int error;
+} _nf_nftnl_pending;
+
+typedef struct {
+    PyObject_HEAD
+    int fd; uint32_t seq;
+    char* buffer; size_t bufsize;
+    _nf_nftnl_pending* head;
+    _nf_nftnl_pending* tail;
+    PyObject* results;
+    PyObject* owner;  /* What answers on the other end, if not the kernel */
+} NetfilterSocketHandle;
+
+static PyObject* NetfilterSocketHandle_new (PyTypeObject* type, PyTupleObject* args) {
+    NetfilterSocketHandle* self;
+    self = (NetfilterSocketHandle*) type->tp_alloc(type, 0);
+    self->fd = -1;
+    self->seq = time(NULL);
+    self->buffer = NULL;
+    self->bufsize = 0;
+    self->head = NULL;
+    self->tail = NULL;
+    self->owner = NULL;
+    self->results = PyList_New(0);
+    if (!self->results) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    return (PyObject*) self;
+}
+
+static int NetfilterSocketHandle_init (NetfilterSocketHandle* self, PyTupleObject* args) {
+    return 0;
+}
+
+static void NetfilterSocketHandle_dealloc (NetfilterSocketHandle* self) {
+    _nf_nftnl_pending* pending;
+    while ((pending = self->head)) {
+        self->head = pending->next;
+        free(pending->data);
+        free(pending);
+    }
+    if (self->fd >= 0) close(self->fd);
+    if (self->buffer) free(self->buffer);
+    Py_XDECREF(self->results);
+    Py_XDECREF(self->owner);
+    Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+static int _NetfilterSocketHandle_resolve (NetfilterSocketHandle* self, _nf_nftnl_pending* pending,
+                                           _nf_nftnl_pending* prev) {
+    PyObject* result;
+
+    if (prev) prev->next = pending->next;
+    else self->head = pending->next;
+    if (self->tail == pending) self->tail = prev;
+
+    result = Py_BuildValue("(Ii)", pending->first, pending->error);
+    free(pending->data);
+    free(pending);
+    if (!result)
+        return -1;
+    if (PyList_Append(self->results, result) < 0) {
+        Py_DECREF(result);
+        return -1;
+    }
+    Py_DECREF(result);
+    return 0;
+}
+
+/* Grows the send buffer for batches that would not fit, like nft does */
+static void _nf_nftnl_sndbuf (int fd, size_t len) {
+    int size; socklen_t optlen = sizeof(size);
+    if (getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, &optlen) < 0 || (size_t) size >= len)
+        return;
+    size = (int) len;
+    if (setsockopt(fd, SOL_SOCKET, SO_SNDBUFFORCE, &size, sizeof(size)) < 0)
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+}
+
+/* Returns the last message of a serialized batch, or NULL if the batch
+   holds nothing besides its delimiters. That message is made to ask for
+   an acknowledgement, so that an error on any message before it arrives
+   before the batch is considered answered. */
+static struct nlmsghdr* _nf_nftnl_batch_last (char* data, int len) {
+    struct nlmsghdr* msg; struct nlmsghdr* last = NULL;
+
+    for (msg = (struct nlmsghdr*) data; mnl_nlmsg_ok(msg, len); msg = mnl_nlmsg_next(msg, &len)) {
+        if (msg->nlmsg_type == NFNL_MSG_BATCH_BEGIN || msg->nlmsg_type == NFNL_MSG_BATCH_END)
+            continue;
+        last = msg;
+    }
+
+    if (last)
+        last->nlmsg_flags |= NLM_F_ACK;
+    return last;
+}
+
+static int _NetfilterSocketHandle_send (NetfilterSocketHandle* self) {
+    _nf_nftnl_pending* pending; _nf_nftnl_pending* prev = NULL;
+    _nf_nftnl_pending* next;
+    ssize_t ret;
+
+    for (pending = self->head; pending; pending = next) {
+        next = pending->next;
+        if (pending->sent) {
+            prev = pending;
+            continue;
+        }
+
+        _nf_nftnl_sndbuf(self->fd, pending->len);
+        ret = send(self->fd, pending->data, pending->len, MSG_DONTWAIT);
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            break;
+
+        if (ret < 0) {
+            pending->error = -errno;
+            if (_NetfilterSocketHandle_resolve(self, pending, prev) < 0)
+                return -1;
+            continue;
+        }
+
+        pending->sent = 1;
+        prev = pending;
+    }
+
+    return 0;
+}
+
+static int _NetfilterSocketHandle_ack (NetfilterSocketHandle* self, uint32_t seq, int error) {
+    _nf_nftnl_pending* pending; _nf_nftnl_pending* prev = NULL;
+
+    for (pending = self->head; pending && pending->sent; prev = pending, pending = pending->next) {
+        if (seq < pending->first || seq > pending->last)
+            continue;
+        if (error && !pending->error)
+            pending->error = error;
+        /* An error on the batch begin message (EPERM, ENOMEM, ...) means
+           the batch was rejected as a whole and nothing else is answered */
+        if (seq == pending->last || (seq == pending->first && error))
+            return _NetfilterSocketHandle_resolve(self, pending, prev);
+        return 0;
+    }
+
+    return 0;
+}
+
+static int _NetfilterSocketHandle_recv (NetfilterSocketHandle* self) {
+    const struct nlmsghdr* msg; const struct nlmsgerr* err;
+    _nf_nftnl_pending* pending; _nf_nftnl_pending* prev;
+    ssize_t ret; int len;
+
+    for (;;) {
+        ret = recv(self->fd, self->buffer, self->bufsize, MSG_DONTWAIT);
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (ret < 0 && errno == EINTR)
+            continue;
+
+        if (ret < 0 && errno == ENOBUFS) {
+            /* Acknowledgements were dropped, so nothing in flight can be
+               resolved reliably anymore */
+            prev = NULL;
+            for (pending = self->head; pending && pending->sent; pending = self->head) {
+                if (!pending->error)
+                    pending->error = -ENOBUFS;
+                if (_NetfilterSocketHandle_resolve(self, pending, prev) < 0)
+                    return -1;
+            }
+            continue;
+        }
+
+        /* Netlink never sends empty messages, so this is a socketpair whose
+           other end went away: nothing will ever be answered again */
+        if (ret == 0)
+            errno = ECONNRESET;
+        if (ret <= 0) {
+            PyErr_SetFromErrno(PyExc_OSError);
+            return -1;
+        }
+
+        len = (int) ret;
+        for (msg = (const struct nlmsghdr*) self->buffer; mnl_nlmsg_ok(msg, len); msg = mnl_nlmsg_next(msg, &len)) {
+            if (msg->nlmsg_type != NLMSG_ERROR)
+                continue;
+            err = (const struct nlmsgerr*) mnl_nlmsg_get_payload(msg);
+            if (_NetfilterSocketHandle_ack(self, msg->nlmsg_seq, err->error) < 0)
+                return -1;
+        }
+    }
+}
+
+static PyObject* NetfilterSocketHandle_fileno (NetfilterSocketHandle* self) {
+    return PyInt_FromLong((long) self->fd);
+}
+
+static PyObject* NetfilterSocketHandle_queue (NetfilterSocketHandle* self, PyTupleObject* args) {
+    char* data; int datalen; int len;
+    struct nlmsghdr* msg; struct nlmsghdr* last;
+    _nf_nftnl_pending* pending;
+    uint32_t first;
+
+    if (!PyArg_ParseTuple((PyObject*) args, "s#", &data, &datalen)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (bytes batch)");
+        return NULL;
+    }
+
+    pending = calloc(1, sizeof(_nf_nftnl_pending));
+    if (!pending) {
+        PyErr_SetString(PyExc_OSError, "Call to calloc failed");
+        return NULL;
+    }
+
+    pending->data = malloc(datalen ? datalen : 1);
+    if (!pending->data) {
+        free(pending);
+        PyErr_SetString(PyExc_OSError, "Call to malloc failed");
+        return NULL;
+    }
+    memcpy(pending->data, data, datalen);
+    pending->len = datalen;
+
+    /* Batches are renumbered so that those built in the same second by
+       different NetfilterBatchHandle objects never share sequence numbers */
+    first = self->seq;
+    len = datalen;
+    for (msg = (struct nlmsghdr*) pending->data; mnl_nlmsg_ok(msg, len); msg = mnl_nlmsg_next(msg, &len))
+        msg->nlmsg_seq = self->seq++;
+
+    last = _nf_nftnl_batch_last(pending->data, datalen);
+    if (!last) {
+        free(pending->data);
+        free(pending);
+        self->seq = first;
+        PyErr_SetString(PyExc_ValueError, "Batch does not contain any message");
+        return NULL;
+    }
+
+    pending->first = first;
+    pending->last = last->nlmsg_seq;
+    if (self->tail) self->tail->next = pending;
+    else self->head = pending;
+    self->tail = pending;
+
+    /* Send right away if the socket allows it. Whatever fails here is
+       reported by the next call to process_ready. */
+    if (_NetfilterSocketHandle_send(self) < 0)
+        return NULL;
+
+    return PyInt_FromLong((long) first);
+}
+
+static PyObject* NetfilterSocketHandle_process_ready (NetfilterSocketHandle* self) {
+    PyObject* results;
+
+    if (_NetfilterSocketHandle_send(self) < 0)
+        return NULL;
+    if (_NetfilterSocketHandle_recv(self) < 0)
+        return NULL;
+
+    /* Hand over whatever has been resolved so far */
+    results = self->results;
+    self->results = PyList_New(0);
+    if (!self->results) {
+        self->results = results;
+        return NULL;
+    }
+    return results;
+}
+
+static PyObject* NetfilterSocketHandle_pending (NetfilterSocketHandle* self) {
+    _nf_nftnl_pending* pending;
+    uint32_t unsent = 0; uint32_t unacked = 0;
+
+    for (pending = self->head; pending; pending = pending->next) {
+        if (pending->sent) unacked++;
+        else unsent++;
+    }
+
+    return Py_BuildValue("(II)", unsent, unacked);
+}
+
+static PyMemberDef NetfilterSocketHandle_members[] = {
+    {NULL}
+};
+
+static PyMethodDef NetfilterSocketHandle_methods[] = {
+    {"fileno", (PyCFunction) NetfilterSocketHandle_fileno, METH_NOARGS, NULL},
+    {"queue", (PyCFunction) NetfilterSocketHandle_queue, METH_VARARGS, NULL},
+    {"process_ready", (PyCFunction) NetfilterSocketHandle_process_ready, METH_NOARGS, NULL},
+    {"pending", (PyCFunction) NetfilterSocketHandle_pending, METH_NOARGS, NULL},
+    {NULL}
+};
+
+static PyTypeObject NetfilterSocketHandleType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "libnftnlset.NetfilterSocketHandle",           /* tp_name */
+    sizeof(NetfilterSocketHandle),                 /* tp_basicsize */
+    0,                                             /* tp_itemsize */
+    (destructor) NetfilterSocketHandle_dealloc,    /* tp_dealloc */
+    0,                                             /* tp_print */
+    0,                                             /* tp_getattr */
+    0,                                             /* tp_setattr */
+    0,                                             /* tp_compare */
+    0,                                             /* tp_repr */
+    0,                                             /* tp_as_number */
+    0,                                             /* tp_as_sequence */
+    0,                                             /* tp_as_mapping */
+    0,                                             /* tp_hash */
+    0,                                             /* tp_call */
+    0,                                             /* tp_str */
+    0,                                             /* tp_getattro */
+    0,                                             /* tp_setattro */
+    0,                                             /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,      /* tp_flags */
+    "Non-blocking NETLINK_NETFILTER socket",       /* tp_doc */
+    0,                                             /* tp_traverse */
+    0,                                             /* tp_clear */
+    0,                                             /* tp_richcompare */
+    0,                                             /* tp_weaklistoffset */
+    0,                                             /* tp_iter */
+    0,                                             /* tp_iternext */
+    NetfilterSocketHandle_methods,                 /* tp_methods */
+    NetfilterSocketHandle_members,                 /* tp_members */
+    0,                                             /* tp_getset */
+    0,                                             /* tp_base */
+    0,                                             /* tp_dict */
+    0,                                             /* tp_descr_get */
+    0,                                             /* tp_descr_set */
+    0,                                             /* tp_dictoffset */
+    (initproc) NetfilterSocketHandle_init,         /* tp_init */
+    0,                                             /* tp_alloc */
+    (newfunc) NetfilterSocketHandle_new,           /* tp_new */
+};
+
+// END: NetfilterSocketHandle
+
+// BEGIN: NetfilterCacheHandle
+
+/* Set metadata as last dumped from the kernel, keyed by (family, table,
+   name). Every NEWSET carries the low 16 bits of the generation it was
+   dumped at in nfgenmsg.res_id: the dump is tagged with them, and dropped
+   whenever a dump or GETGEN answer of another generation comes in. */
+typedef struct {
+    PyObject_HEAD
+    uint32_t seq; uint32_t gen; int has_gen;
+    uint16_t dump_gen; int has_dump;
+    int interrupted;
+    PyObject* sets;
+} NetfilterCacheHandle;
+
+static PyObject* NetfilterCacheHandle_new (PyTypeObject* type, PyTupleObject* args) {
+    NetfilterCacheHandle* self;
+    self = (NetfilterCacheHandle*) type->tp_alloc(type, 0);
+    self->seq = time(NULL);
+    self->gen = 0;
+    self->has_gen = 0;
+    self->dump_gen = 0;
+    self->has_dump = 0;
+    self->interrupted = 0;
+    self->sets = PyDict_New();
+    if (!self->sets) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    return (PyObject*) self;
+}
+
+static int NetfilterCacheHandle_init (NetfilterCacheHandle* self, PyTupleObject* args) {
+    return 0;
+}
+
+static void NetfilterCacheHandle_dealloc (NetfilterCacheHandle* self) {
+    Py_XDECREF(self->sets);
+    Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+static PyObject* _NetfilterCacheHandle_request (NetfilterCacheHandle* self, uint16_t type,
+                                                uint16_t family, uint16_t flags) {
+    char buffer[MNL_NLMSG_HDRLEN + MNL_ALIGN(sizeof(struct nfgenmsg))];
+    struct nlmsghdr* msg;
+    msg = nftnl_nlmsg_build_hdr(buffer, type, family, flags, self->seq++);
+    return PyString_FromStringAndSize((const char*) msg, (Py_ssize_t) msg->nlmsg_len);
+}
+
+static PyObject* NetfilterCacheHandle_gen_request (NetfilterCacheHandle* self) {
+    return _NetfilterCacheHandle_request(self, NFT_MSG_GETGEN, NFPROTO_UNSPEC, 0);
+}
+
+static PyObject* NetfilterCacheHandle_sets_request (NetfilterCacheHandle* self, PyTupleObject* args) {
+    uint16_t family;
+
+    if (!PyArg_ParseTuple((PyObject*) args, "H", &family)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (uint16_t family)");
+        return NULL;
+    }
+
+    self->interrupted = 0;
+    return _NetfilterCacheHandle_request(self, NFT_MSG_GETSET, family, NLM_F_DUMP);
+}
+
+static PyObject* _NetfilterCacheHandle_key (uint16_t family, const char* table, const char* name) {
+    return Py_BuildValue("(Hss)", family, table ? table : "", name ? name : "");
+}
+
+static PyObject* _NetfilterCacheHandle_wrap (struct nftnl_set* handle_struct) {
+    PyObject* empty;
+    NetfilterSetHandle* handle_object;
+
+    empty = PyTuple_New(0);
+    handle_object = (NetfilterSetHandle*) PyObject_CallObject((PyObject*) &NetfilterSetHandleType, empty);
+    Py_DECREF(empty);
+
+    if (!handle_object) {
+        nftnl_set_free(handle_struct);
+        return NULL;
+    }
+
+    handle_object->handle = handle_struct;
+    return (PyObject*) handle_object;
+}
+
+static int _NetfilterCacheHandle_gen_cb (const struct nlattr* attr, void* data) {
+    if (mnl_attr_get_type(attr) == NFTA_GEN_ID && mnl_attr_validate(attr, MNL_TYPE_U32) >= 0)
+        *(const struct nlattr**) data = attr;
+    return MNL_CB_OK;
+}
+
+static int _NetfilterCacheHandle_cb (const struct nlmsghdr* msg, void* data) {
+    NetfilterCacheHandle* self = (NetfilterCacheHandle*) data;
+    const struct nlattr* attr = NULL;
+    struct nftnl_set* handle_struct;
+    PyObject* handle_object; PyObject* key;
+    const struct nfgenmsg* nfg;
+    uint32_t gen; uint16_t dump_gen;
+
+    switch (NFNL_MSG_TYPE(msg->nlmsg_type)) {
+        case NFT_MSG_NEWGEN:
+            if (mnl_attr_parse(msg, sizeof(struct nfgenmsg), _NetfilterCacheHandle_gen_cb, &attr) < 0 || !attr)
+                return MNL_CB_ERROR;
+            gen = ntohl(mnl_attr_get_u32(attr));
+            if (self->has_dump && self->dump_gen != (uint16_t) gen) {
+                PyDict_Clear(self->sets);
+                self->has_dump = 0;
+            }
+            self->gen = gen;
+            self->has_gen = 1;
+            return MNL_CB_OK;
+
+        case NFT_MSG_NEWSET:
+            /* A generation fed earlier does not describe a later dump: it
+               is forgotten until a GETGEN answer matching the dump comes */
+            nfg = (const struct nfgenmsg*) mnl_nlmsg_get_payload(msg);
+            dump_gen = ntohs(nfg->res_id);
+            if (self->has_dump && self->dump_gen != dump_gen)
+                PyDict_Clear(self->sets);
+            if (self->has_gen && (uint16_t) self->gen != dump_gen)
+                self->has_gen = 0;
+            self->dump_gen = dump_gen;
+            self->has_dump = 1;
+
+            handle_struct = nftnl_set_alloc();
+            if (!handle_struct)
+                return MNL_CB_ERROR;
+            if (nftnl_set_nlmsg_parse(msg, handle_struct) < 0) {
+                nftnl_set_free(handle_struct);
+                return MNL_CB_ERROR;
+            }
+
+            handle_object = _NetfilterCacheHandle_wrap(handle_struct);
+            if (!handle_object)
+                return MNL_CB_ERROR;
+
+            key = _NetfilterCacheHandle_key(nftnl_set_get_u32(handle_struct, NFTNL_SET_FAMILY),
+                                            nftnl_set_get_str(handle_struct, NFTNL_SET_TABLE),
+                                            nftnl_set_get_str(handle_struct, NFTNL_SET_NAME));
+            if (!key || PyDict_SetItem(self->sets, key, handle_object) < 0) {
+                Py_XDECREF(key);
+                Py_DECREF(handle_object);
+                return MNL_CB_ERROR;
+            }
+            Py_DECREF(key);
+            Py_DECREF(handle_object);
+            return MNL_CB_OK;
+    }
+
+    return MNL_CB_OK;
+}
+
+/* Walks the messages by hand rather than with mnl_cb_run, which stops at
+   the first NLM_F_DUMP_INTR message and would leave the rest of the dump
+   to be taken for a consistent one */
+static PyObject* NetfilterCacheHandle_feed (NetfilterCacheHandle* self, PyObject* args) {
+    const struct nlmsghdr* msg; const struct nlmsgerr* err;
+    char* buf; int len;
+
+    if (!PyArg_ParseTuple((PyObject*) args, "s#", &buf, &len)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (char* buf)");
+        return NULL;
+    }
+
+    for (msg = (const struct nlmsghdr*) buf; mnl_nlmsg_ok(msg, len); msg = mnl_nlmsg_next(msg, &len)) {
+        if (msg->nlmsg_flags & NLM_F_DUMP_INTR) {
+            /* The ruleset changed while being dumped: whatever this dump
+               delivers is dropped, and it has to be requested again */
+            PyDict_Clear(self->sets);
+            self->has_gen = 0;
+            self->has_dump = 0;
+            self->interrupted = 1;
+        }
+
+        switch (msg->nlmsg_type) {
+            case NLMSG_NOOP:
+            case NLMSG_OVERRUN:
+                continue;
+            case NLMSG_DONE:
+                return PyInt_FromLong(MNL_CB_STOP);
+            case NLMSG_ERROR:
+                err = (const struct nlmsgerr*) mnl_nlmsg_get_payload(msg);
+                if (!err->error)
+                    return PyInt_FromLong(MNL_CB_STOP);
+                errno = -err->error;
+                return PyInt_FromLong(MNL_CB_ERROR);
+        }
+
+        if (self->interrupted && NFNL_MSG_TYPE(msg->nlmsg_type) == NFT_MSG_NEWSET)
+            continue;
+        if (_NetfilterCacheHandle_cb(msg, self) == MNL_CB_ERROR) {
+            if (PyErr_Occurred())
+                return NULL;
+            return PyInt_FromLong(MNL_CB_ERROR);
+        }
+    }
+
+    return PyInt_FromLong(MNL_CB_OK);
+}
+
+static PyObject* NetfilterCacheHandle_interrupted (NetfilterCacheHandle* self) {
+    return PyBool_FromLong(self->interrupted);
+}
+
+static PyObject* NetfilterCacheHandle_generation (NetfilterCacheHandle* self) {
+    if (!self->has_gen)
+        Py_RETURN_NONE;
+    return PyLong_FromUnsignedLong((unsigned long) self->gen);
+}
+
+static NetfilterSetHandle* _NetfilterCacheHandle_find (NetfilterCacheHandle* self, uint16_t family,
+                                                      const char* table, const char* name) {
+    PyObject* key; PyObject* cached;
+
+    key = _NetfilterCacheHandle_key(family, table, name);
+    if (!key)
+        return NULL;
+    cached = PyDict_GetItem(self->sets, key);
+    Py_DECREF(key);
+
+    if (!cached)
+        PyErr_Format(PyExc_LookupError, "Set %s %s is not cached", table ? table : "", name ? name : "");
+    return (NetfilterSetHandle*) cached;
+}
+
+static PyObject* NetfilterCacheHandle_get (NetfilterCacheHandle* self, PyTupleObject* args) {
+    char* table; char* name; uint16_t family;
+    NetfilterSetHandle* cached; struct nftnl_set* handle_struct;
+    struct nlmsghdr* msg; char* buffer; int ret;
+
+    if (!PyArg_ParseTuple((PyObject*) args, "ssH", &table, &name, &family)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (char* table, char* name, uint16_t family)");
+        return NULL;
+    }
+
+    cached = _NetfilterCacheHandle_find(self, family, table, name);
+    if (!cached) {
+        PyErr_Clear();
+        Py_RETURN_NONE;
+    }
+
+    /* Callers get their own copy, so adding elements never touches the
+       cache. The copy is made by encoding the cached set and parsing it
+       back, which carries everything libnftnl knows about it, including
+       concatenation fields and expressions. */
+    handle_struct = nftnl_set_alloc();
+    if (!handle_struct) {
+        PyErr_SetString(PyExc_OSError, "Call to nftnl_set_alloc failed");
+        return NULL;
+    }
+
+    buffer = malloc(MNL_SOCKET_DUMP_SIZE);
+    if (!buffer) {
+        nftnl_set_free(handle_struct);
+        PyErr_SetString(PyExc_OSError, "Call to malloc failed");
+        return NULL;
+    }
+
+    msg = nftnl_nlmsg_build_hdr(buffer, NFT_MSG_NEWSET, family, 0, 0);
+    nftnl_set_nlmsg_build_payload(msg, cached->handle);
+    ret = nftnl_set_nlmsg_parse(msg, handle_struct);
+    free(buffer);
+
+    if (ret < 0) {
+        nftnl_set_free(handle_struct);
+        PyErr_SetString(PyExc_OSError, "Call to nftnl_set_nlmsg_parse failed");
+        return NULL;
+    }
+
+    return _NetfilterCacheHandle_wrap(handle_struct);
+}
+
+static PyObject* NetfilterCacheHandle_validate (NetfilterCacheHandle* self, PyTupleObject* args) {
+    NetfilterSetHandle* set; NetfilterSetHandle* cached;
+    struct nftnl_set_elem* elem; uint16_t family;
+    uint32_t flags; uint32_t key_len; uint32_t data_len; uint32_t data_type;
+    uint32_t rawlen; Py_ssize_t i;
+
+    if (!PyArg_ParseTuple((PyObject*) args, "OH", &set, &family)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, uint16_t family)");
+        return NULL;
+    }
+
+    if (!PyObject_IsInstance((PyObject*) set, (PyObject*) &NetfilterSetHandleType)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, uint16_t family)");
+        return NULL;
+    }
+
+    cached = _NetfilterCacheHandle_find(self, family,
+                                        nftnl_set_get_str(set->handle, NFTNL_SET_TABLE),
+                                        nftnl_set_get_str(set->handle, NFTNL_SET_NAME));
+    if (!cached)
+        return NULL;
+
+    flags = nftnl_set_get_u32(cached->handle, NFTNL_SET_FLAGS);
+    key_len = nftnl_set_get_u32(cached->handle, NFTNL_SET_KEY_LEN);
+    data_len = nftnl_set_get_u32(cached->handle, NFTNL_SET_DATA_LEN);
+    data_type = nftnl_set_get_u32(cached->handle, NFTNL_SET_DATA_TYPE);
+
+    for (i = 0; i < PyList_GET_SIZE(set->elements); i++) {
+        elem = ((NetfilterElementHandle*) PyList_GET_ITEM(set->elements, i))->handle;
+
+        if (!nftnl_set_elem_is_set(elem, NFTNL_SET_ELEM_KEY) ||
+            (nftnl_set_elem_get(elem, NFTNL_SET_ELEM_KEY, &rawlen), rawlen != key_len)) {
+            PyErr_Format(PyExc_ValueError, "Element %zd: key must be %u bytes", i, key_len);
+            return NULL;
+        }
+
+        if (nftnl_set_elem_is_set(elem, NFTNL_SET_ELEM_KEY_END) &&
+            (!(flags & NFT_SET_INTERVAL) ||
+             (nftnl_set_elem_get(elem, NFTNL_SET_ELEM_KEY_END, &rawlen), rawlen != key_len))) {
+            PyErr_Format(PyExc_ValueError, "Element %zd: key_end needs an interval set and %u bytes", i, key_len);
+            return NULL;
+        }
+
+        if (nftnl_set_elem_is_set(elem, NFTNL_SET_ELEM_DATA) &&
+            (!(flags & NFT_SET_MAP) || data_type == NFT_DATA_VERDICT ||
+             (nftnl_set_elem_get(elem, NFTNL_SET_ELEM_DATA, &rawlen), rawlen != data_len))) {
+            PyErr_Format(PyExc_ValueError, "Element %zd: data needs a map and %u bytes", i, data_len);
+            return NULL;
+        }
+
+        if (nftnl_set_elem_is_set(elem, NFTNL_SET_ELEM_VERDICT) &&
+            (!(flags & NFT_SET_MAP) || data_type != NFT_DATA_VERDICT)) {
+            PyErr_Format(PyExc_ValueError, "Element %zd: verdict needs a verdict map", i);
+            return NULL;
+        }
+
+        if (nftnl_set_elem_is_set(elem, NFTNL_SET_ELEM_TIMEOUT) && !(flags & NFT_SET_TIMEOUT)) {
+            PyErr_Format(PyExc_ValueError, "Element %zd: timeout needs a set with timeouts", i);
+            return NULL;
+        }
+
+        if (nftnl_set_elem_is_set(elem, NFTNL_SET_ELEM_OBJREF) && !(flags & NFT_SET_OBJECT)) {
+            PyErr_Format(PyExc_ValueError, "Element %zd: objref needs an object map", i);
+            return NULL;
+        }
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyMemberDef NetfilterCacheHandle_members[] = {
+    {NULL}
+};
+
+static PyMethodDef NetfilterCacheHandle_methods[] = {
+    {"gen_request", (PyCFunction) NetfilterCacheHandle_gen_request, METH_NOARGS, NULL},
+    {"sets_request", (PyCFunction) NetfilterCacheHandle_sets_request, METH_VARARGS, NULL},
+    {"feed", (PyCFunction) NetfilterCacheHandle_feed, METH_VARARGS, NULL},
+    {"generation", (PyCFunction) NetfilterCacheHandle_generation, METH_NOARGS, NULL},
+    {"interrupted", (PyCFunction) NetfilterCacheHandle_interrupted, METH_NOARGS, NULL},
+    {"get", (PyCFunction) NetfilterCacheHandle_get, METH_VARARGS, NULL},
+    {"validate", (PyCFunction) NetfilterCacheHandle_validate, METH_VARARGS, NULL},
+    {NULL}
+};
+
+static PyTypeObject NetfilterCacheHandleType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "libnftnlset.NetfilterCacheHandle",            /* tp_name */
+    sizeof(NetfilterCacheHandle),                  /* tp_basicsize */
+    0,                                             /* tp_itemsize */
+    (destructor) NetfilterCacheHandle_dealloc,     /* tp_dealloc */
+    0,                                             /* tp_print */
+    0,                                             /* tp_getattr */
+    0,                                             /* tp_setattr */
+    0,                                             /* tp_compare */
+    0,                                             /* tp_repr */
+    0,                                             /* tp_as_number */
+    0,                                             /* tp_as_sequence */
+    0,                                             /* tp_as_mapping */
+    0,                                             /* tp_hash */
+    0,                                             /* tp_call */
+    0,                                             /* tp_str */
+    0,                                             /* tp_getattro */
+    0,                                             /* tp_setattro */
+    0,                                             /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,      /* tp_flags */
+    "Generation-aware cache of set metadata",      /* tp_doc */
+    0,                                             /* tp_traverse */
+    0,                                             /* tp_clear */
+    0,                                             /* tp_richcompare */
+    0,                                             /* tp_weaklistoffset */
+    0,                                             /* tp_iter */
+    0,                                             /* tp_iternext */
+    NetfilterCacheHandle_methods,                  /* tp_methods */
+    NetfilterCacheHandle_members,                  /* tp_members */
+    0,                                             /* tp_getset */
+    0,                                             /* tp_base */
+    0,                                             /* tp_dict */
+    0,                                             /* tp_descr_get */
+    0,                                             /* tp_descr_set */
+    0,                                             /* tp_dictoffset */
+    (initproc) NetfilterCacheHandle_init,          /* tp_init */
+    0,                                             /* tp_alloc */
+    (newfunc) NetfilterCacheHandle_new,            /* tp_new */
+};
+
+// END: NetfilterCacheHandle
+
+// BEGIN: NetfilterLookupHandle
+
+/* Point lookups of many keys at once. Every key gets its own GETSETELEM
+   request so that a missing key only fails its own message; answers are
+   matched back to keys through their sequence number. Requests go out in
+   windows of at most `window` keys, so the answers to one window fit the
+   receive buffer and a single send never exceeds the socket limits. */
+#define NF_NFTNL_LOOKUP_WINDOW 64
+
+typedef struct {
+    PyObject_HEAD
+    uint32_t seq; uint32_t count; uint32_t remaining;
+    uint32_t data_len; int error;
+    uint32_t window; uint32_t next; uint32_t inflight; size_t msglen;
+    PyObject* request;
+    uint8_t* found; uint8_t* answered; uint8_t* sent;
+    char* data; uint64_t* expiration;
+} NetfilterLookupHandle;
+
+static PyObject* NetfilterLookupHandle_new (PyTypeObject* type, PyTupleObject* args) {
+    NetfilterLookupHandle* self;
+    self = (NetfilterLookupHandle*) type->tp_alloc(type, 0);
+    self->seq = 0;
+    self->count = 0;
+    self->remaining = 0;
+    self->data_len = 0;
+    self->error = 0;
+    self->window = NF_NFTNL_LOOKUP_WINDOW;
+    self->next = 0;
+    self->inflight = 0;
+    self->msglen = 0;
+    self->request = NULL;
+    self->found = NULL;
+    self->answered = NULL;
+    self->sent = NULL;
+    self->data = NULL;
+    self->expiration = NULL;
+    return (PyObject*) self;
+}
+
+static int NetfilterLookupHandle_init (NetfilterLookupHandle* self, PyTupleObject* args) {
+    return 0;
+}
+
+static void NetfilterLookupHandle_dealloc (NetfilterLookupHandle* self) {
+    Py_XDECREF(self->request);
+    if (self->found) free(self->found);
+    if (self->answered) free(self->answered);
+    if (self->sent) free(self->sent);
+    if (self->data) free(self->data);
+    if (self->expiration) free(self->expiration);
+    Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+typedef struct {
+    NetfilterLookupHandle* self;
+    uint32_t index;
+} _NetfilterLookupHandle_match;
+
+static int _NetfilterLookupHandle_elem_cb (const struct nlattr** tb, void* data) {
+    _NetfilterLookupHandle_match* match = (_NetfilterLookupHandle_match*) data;
+    NetfilterLookupHandle* self = match->self;
+    const struct nlattr* value;
+
+    self->found[match->index / 8] |= 1 << (match->index % 8);
+
+    value = _nf_nftnl_attr_data_value(tb[NFTA_SET_ELEM_DATA]);
+    if (value && self->data_len && mnl_attr_get_payload_len(value) == self->data_len)
+        memcpy(self->data + (size_t) match->index * self->data_len,
+               mnl_attr_get_payload(value), self->data_len);
+
+    if (tb[NFTA_SET_ELEM_EXPIRATION])
+        self->expiration[match->index] = be64toh(mnl_attr_get_u64(tb[NFTA_SET_ELEM_EXPIRATION]));
+
+    /* A single key was asked for, so a single element is expected */
+    return MNL_CB_STOP;
+}
+
+static size_t _nf_nftnl_set_lookup_build (char* buffer, struct nftnl_set* set, uint16_t family,
+                                          uint32_t seq, const char* key, uint32_t key_len) {
+    struct nlmsghdr* msg; struct nlattr* nest;
+    msg = nftnl_nlmsg_build_hdr(buffer, NFT_MSG_GETSETELEM, family, 0, seq);
+    _nf_nftnl_set_elem_build_def(msg, set);
+    nest = mnl_attr_nest_start(msg, NFTA_SET_ELEM_LIST_ELEMENTS);
+    _nf_nftnl_set_key_build(msg, key, key_len, 1);
+    mnl_attr_nest_end(msg, nest);
+    return MNL_ALIGN(msg->nlmsg_len);
+}
+
+static PyObject* NetfilterLookupHandle_feed (NetfilterLookupHandle* self, PyObject* args) {
+    const struct nlmsghdr* msg; const struct nlmsgerr* err;
+    _NetfilterLookupHandle_match match;
+    char* buf; int len; uint32_t index;
+
+    if (!PyArg_ParseTuple((PyObject*) args, "s#", &buf, &len)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (char* buf)");
+        return NULL;
+    }
+
+    for (msg = (const struct nlmsghdr*) buf; mnl_nlmsg_ok(msg, len); msg = mnl_nlmsg_next(msg, &len)) {
+        index = msg->nlmsg_seq - self->seq;
+        if (index >= self->count || self->answered[index / 8] & (1 << (index % 8)))
+            continue;
+
+        if (msg->nlmsg_type == NLMSG_ERROR) {
+            err = (const struct nlmsgerr*) mnl_nlmsg_get_payload(msg);
+            if (!err->error)
+                continue;
+            /* ENOENT simply means the key is not in the set */
+            if (err->error != -ENOENT && !self->error)
+                self->error = err->error;
+        } else if (NFNL_MSG_TYPE(msg->nlmsg_type) == NFT_MSG_NEWSETELEM) {
+            match.self = self;
+            match.index = index;
+            _nf_nftnl_set_elems_parse(msg, _NetfilterLookupHandle_elem_cb, &match);
+        } else {
+            continue;
+        }
+
+        self->answered[index / 8] |= 1 << (index % 8);
+        self->remaining--;
+        /* Late answers to a window that overran are still taken */
+        if (self->sent[index / 8] & (1 << (index % 8))) {
+            self->sent[index / 8] &= ~(1 << (index % 8));
+            self->inflight--;
+        }
+    }
+
+    return PyInt_FromLong((long) self->remaining);
+}
+
+/* Next window of requests, or an empty string while the previous window
+   is still being answered or once every key has been answered */
+static PyObject* NetfilterLookupHandle_request (NetfilterLookupHandle* self) {
+    PyObject* request; char* buffer; uint32_t index; uint32_t keys = 0; uint32_t scanned;
+
+    if (self->inflight || !self->remaining)
+        return PyString_FromStringAndSize(NULL, 0);
+
+    request = PyString_FromStringAndSize(NULL, (Py_ssize_t) (self->window * self->msglen));
+    if (!request)
+        return NULL;
+    buffer = PyString_AS_STRING(request);
+
+    /* Keys are asked for round-robin, so a window lost to an overrun is
+       asked for again once the keys after it had their turn */
+    for (scanned = 0; scanned < self->count && keys < self->window; scanned++) {
+        index = self->next;
+        self->next = (self->next + 1) % self->count;
+        if (self->answered[index / 8] & (1 << (index % 8)))
+            continue;
+        memcpy(buffer, PyString_AS_STRING(self->request) + (size_t) index * self->msglen, self->msglen);
+        buffer += self->msglen;
+        self->sent[index / 8] |= 1 << (index % 8);
+        keys++;
+    }
+    self->inflight = keys;
+
+    if (_PyString_Resize(&request, (Py_ssize_t) (keys * self->msglen)) < 0)
+        return NULL;
+    return request;
+}
+
+/* The socket dropped answers with ENOBUFS: the keys of the window in flight
+   that are still unanswered are lost and go into a later window. Returns how
+   many keys were lost. */
+static PyObject* NetfilterLookupHandle_overrun (NetfilterLookupHandle* self) {
+    uint32_t lost = self->inflight;
+    memset(self->sent, 0, (self->count + 7) / 8 + 1);
+    self->inflight = 0;
+    return PyInt_FromLong((long) lost);
+}
+
+static PyObject* NetfilterLookupHandle_answered (NetfilterLookupHandle* self) {
+    return PyString_FromStringAndSize((const char*) self->answered, (Py_ssize_t) (self->count + 7) / 8);
+}
+
+static PyObject* NetfilterLookupHandle_found (NetfilterLookupHandle* self) {
+    return PyString_FromStringAndSize((const char*) self->found, (Py_ssize_t) (self->count + 7) / 8);
+}
+
+static PyObject* NetfilterLookupHandle_data (NetfilterLookupHandle* self) {
+    return PyString_FromStringAndSize(self->data, (Py_ssize_t) self->count * self->data_len);
+}
+
+static PyObject* NetfilterLookupHandle_expiration (NetfilterLookupHandle* self) {
+    return PyString_FromStringAndSize((const char*) self->expiration,
+                                      (Py_ssize_t) self->count * sizeof(uint64_t));
+}
+
+static PyObject* NetfilterLookupHandle_error (NetfilterLookupHandle* self) {
+    return PyInt_FromLong((long) self->error);
+}
+
+static PyMemberDef NetfilterLookupHandle_members[] = {
+    {NULL}
+};
+
+static PyMethodDef NetfilterLookupHandle_methods[] = {
+    {"request", (PyCFunction) NetfilterLookupHandle_request, METH_NOARGS, NULL},
+    {"feed", (PyCFunction) NetfilterLookupHandle_feed, METH_VARARGS, NULL},
+    {"overrun", (PyCFunction) NetfilterLookupHandle_overrun, METH_NOARGS, NULL},
+    {"answered", (PyCFunction) NetfilterLookupHandle_answered, METH_NOARGS, NULL},
+    {"found", (PyCFunction) NetfilterLookupHandle_found, METH_NOARGS, NULL},
+    {"data", (PyCFunction) NetfilterLookupHandle_data, METH_NOARGS, NULL},
+    {"expiration", (PyCFunction) NetfilterLookupHandle_expiration, METH_NOARGS, NULL},
+    {"error", (PyCFunction) NetfilterLookupHandle_error, METH_NOARGS, NULL},
+    {NULL}
+};
+
+static PyTypeObject NetfilterLookupHandleType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "libnftnlset.NetfilterLookupHandle",           /* tp_name */
+    sizeof(NetfilterLookupHandle),                 /* tp_basicsize */
+    0,                                             /* tp_itemsize */
+    (destructor) NetfilterLookupHandle_dealloc,    /* tp_dealloc */
+    0,                                             /* tp_print */
+    0,                                             /* tp_getattr */
+    0,                                             /* tp_setattr */
+    0,                                             /* tp_compare */
+    0,                                             /* tp_repr */
+    0,                                             /* tp_as_number */
+    0,                                             /* tp_as_sequence */
+    0,                                             /* tp_as_mapping */
+    0,                                             /* tp_hash */
+    0,                                             /* tp_call */
+    0,                                             /* tp_str */
+    0,                                             /* tp_getattro */
+    0,                                             /* tp_setattro */
+    0,                                             /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,      /* tp_flags */
+    "Batched GETSETELEM point lookups",            /* tp_doc */
+    0,                                             /* tp_traverse */
+    0,                                             /* tp_clear */
+    0,                                             /* tp_richcompare */
+    0,                                             /* tp_weaklistoffset */
+    0,                                             /* tp_iter */
+    0,                                             /* tp_iternext */
+    NetfilterLookupHandle_methods,                 /* tp_methods */
+    NetfilterLookupHandle_members,                 /* tp_members */
+    0,                                             /* tp_getset */
+    0,                                             /* tp_base */
+    0,                                             /* tp_dict */
+    0,                                             /* tp_descr_get */
+    0,                                             /* tp_descr_set */
+    0,                                             /* tp_dictoffset */
+    (initproc) NetfilterLookupHandle_init,         /* tp_init */
+    0,                                             /* tp_alloc */
+    (newfunc) NetfilterLookupHandle_new,           /* tp_new */
+};
+
+// END: NetfilterLookupHandle
+
+// BEGIN: NetfilterDumpHandle
+
+enum {
+    NF_NFTNL_EXPR_COUNTER = 0x01,
+    NF_NFTNL_EXPR_QUOTA = 0x02,
+    NF_NFTNL_EXPR_LIMIT = 0x04,
+    NF_NFTNL_EXPR_CONNLIMIT = 0x08,
+};
+
+typedef struct {
+    char* data; size_t len; size_t cap;
+} _nf_nftnl_column;
+
+static int _nf_nftnl_column_append (_nf_nftnl_column* column, const void* data, size_t size) {
+    size_t cap; char* buffer;
+
+    if (column->len + size > column->cap) {
+        cap = column->cap ? column->cap : 4096;
+        while (cap < column->len + size)
+            cap *= 2;
+        buffer = realloc(column->data, cap);
+        if (!buffer)
+            return -1;
+        column->data = buffer;
+        column->cap = cap;
+    }
+
+    memcpy(column->data + column->len, data, size);
+    column->len += size;
+    return 0;
+}
+
+/* A GETSETELEM dump decoded column by column: one row per element, with
+   the state of its counter, quota and connlimit expressions alongside its
+   key. Nothing is allocated per element. */
+typedef struct {
+    PyObject_HEAD
+    uint32_t seq; uint32_t key_len;
+    uint32_t count; int error; int interrupted;
+    PyObject* request;
+    _nf_nftnl_column keys;
+    _nf_nftnl_column packets;
+    _nf_nftnl_column bytes;
+    _nf_nftnl_column consumed;
+    _nf_nftnl_column connections;
+    _nf_nftnl_column exprs;
+} NetfilterDumpHandle;
+
+static PyObject* NetfilterDumpHandle_new (PyTypeObject* type, PyTupleObject* args) {
+    NetfilterDumpHandle* self;
+    self = (NetfilterDumpHandle*) type->tp_alloc(type, 0);
+    self->seq = 0;
+    self->key_len = 0;
+    self->count = 0;
+    self->error = 0;
+    self->interrupted = 0;
+    self->request = NULL;
+    memset(&self->keys, 0, sizeof(_nf_nftnl_column));
+    memset(&self->packets, 0, sizeof(_nf_nftnl_column));
+    memset(&self->bytes, 0, sizeof(_nf_nftnl_column));
+    memset(&self->consumed, 0, sizeof(_nf_nftnl_column));
+    memset(&self->connections, 0, sizeof(_nf_nftnl_column));
+    memset(&self->exprs, 0, sizeof(_nf_nftnl_column));
+    return (PyObject*) self;
+}
+
+static int NetfilterDumpHandle_init (NetfilterDumpHandle* self, PyTupleObject* args) {
+    return 0;
+}
+
+static void NetfilterDumpHandle_dealloc (NetfilterDumpHandle* self) {
+    Py_XDECREF(self->request);
+    free(self->keys.data);
+    free(self->packets.data);
+    free(self->bytes.data);
+    free(self->consumed.data);
+    free(self->connections.data);
+    free(self->exprs.data);
+    Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+typedef struct {
+    uint8_t exprs;
+    uint64_t packets; uint64_t bytes;
+    uint64_t consumed; uint64_t connections;
+} _NetfilterDumpHandle_row;
+
+static void _NetfilterDumpHandle_expr (_NetfilterDumpHandle_row* row, const struct nlattr* expr) {
+    const struct nlattr* tb[NFTA_EXPR_MAX + 1];
+    const struct nlattr* counter[NFTA_COUNTER_MAX + 1];
+    const struct nlattr* quota[NFTA_QUOTA_MAX + 1];
+    const struct nlattr* connlimit[NFTA_CONNLIMIT_MAX + 1];
+    const char* name;
+
+    _nf_nftnl_attr_parse_nested(expr, tb, NFTA_EXPR_MAX);
+    if (!tb[NFTA_EXPR_NAME] || !tb[NFTA_EXPR_DATA])
+        return;
+    name = mnl_attr_get_str(tb[NFTA_EXPR_NAME]);
+
+    if (!strcmp(name, "counter")) {
+        _nf_nftnl_attr_parse_nested(tb[NFTA_EXPR_DATA], counter, NFTA_COUNTER_MAX);
+        row->exprs |= NF_NFTNL_EXPR_COUNTER;
+        if (counter[NFTA_COUNTER_PACKETS])
+            row->packets = be64toh(mnl_attr_get_u64(counter[NFTA_COUNTER_PACKETS]));
+        if (counter[NFTA_COUNTER_BYTES])
+            row->bytes = be64toh(mnl_attr_get_u64(counter[NFTA_COUNTER_BYTES]));
+    } else if (!strcmp(name, "quota")) {
+        _nf_nftnl_attr_parse_nested(tb[NFTA_EXPR_DATA], quota, NFTA_QUOTA_MAX);
+        row->exprs |= NF_NFTNL_EXPR_QUOTA;
+        if (quota[NFTA_QUOTA_CONSUMED])
+            row->consumed = be64toh(mnl_attr_get_u64(quota[NFTA_QUOTA_CONSUMED]));
+    } else if (!strcmp(name, "limit")) {
+        row->exprs |= NF_NFTNL_EXPR_LIMIT;
+    } else if (!strcmp(name, "connlimit")) {
+        _nf_nftnl_attr_parse_nested(tb[NFTA_EXPR_DATA], connlimit, NFTA_CONNLIMIT_MAX);
+        row->exprs |= NF_NFTNL_EXPR_CONNLIMIT;
+        if (connlimit[NFTA_CONNLIMIT_COUNT])
+            row->connections = ntohl(mnl_attr_get_u32(connlimit[NFTA_CONNLIMIT_COUNT]));
+    }
+}
+
+static int _NetfilterDumpHandle_elem_cb (const struct nlattr** tb, void* data) {
+    NetfilterDumpHandle* self = (NetfilterDumpHandle*) data;
+    _NetfilterDumpHandle_row row;
+    const struct nlattr* key; const struct nlattr* expr;
+    char padded[NFT_DATA_VALUE_MAXLEN];
+    uint32_t key_len;
+
+    memset(&row, 0, sizeof(row));
+    memset(padded, 0, sizeof(padded));
+
+    key = _nf_nftnl_attr_data_value(tb[NFTA_SET_ELEM_KEY]);
+    key_len = key ? mnl_attr_get_payload_len(key) : 0;
+    if (key_len > NFT_DATA_VALUE_MAXLEN)
+        key_len = NFT_DATA_VALUE_MAXLEN;
+    if (!self->key_len)
+        self->key_len = key_len;
+    if (key)
+        memcpy(padded, mnl_attr_get_payload(key), key_len < self->key_len ? key_len : self->key_len);
+
+    if (tb[NFTA_SET_ELEM_EXPR])
+        _NetfilterDumpHandle_expr(&row, tb[NFTA_SET_ELEM_EXPR]);
+    if (tb[NFTA_SET_ELEM_EXPRESSIONS])
+        mnl_attr_for_each_nested(expr, tb[NFTA_SET_ELEM_EXPRESSIONS])
+            _NetfilterDumpHandle_expr(&row, expr);
+
+    if (_nf_nftnl_column_append(&self->keys, padded, self->key_len) < 0 ||
+        _nf_nftnl_column_append(&self->packets, &row.packets, sizeof(uint64_t)) < 0 ||
+        _nf_nftnl_column_append(&self->bytes, &row.bytes, sizeof(uint64_t)) < 0 ||
+        _nf_nftnl_column_append(&self->consumed, &row.consumed, sizeof(uint64_t)) < 0 ||
+        _nf_nftnl_column_append(&self->connections, &row.connections, sizeof(uint64_t)) < 0 ||
+        _nf_nftnl_column_append(&self->exprs, &row.exprs, sizeof(uint8_t)) < 0)
+        return MNL_CB_ERROR;
+
+    self->count++;
+    return MNL_CB_OK;
+}
+
+static PyObject* NetfilterDumpHandle_feed (NetfilterDumpHandle* self, PyObject* args) {
+    const struct nlmsghdr* msg; const struct nlmsgerr* err;
+    char* buf; int len;
+
+    if (!PyArg_ParseTuple((PyObject*) args, "s#", &buf, &len)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (char* buf)");
+        return NULL;
+    }
+
+    for (msg = (const struct nlmsghdr*) buf; mnl_nlmsg_ok(msg, len); msg = mnl_nlmsg_next(msg, &len)) {
+        if (msg->nlmsg_seq != self->seq)
+            continue;
+        if (msg->nlmsg_flags & NLM_F_DUMP_INTR)
+            self->interrupted = 1;
+
+        switch (msg->nlmsg_type) {
+            case NLMSG_DONE:
+                return PyInt_FromLong(MNL_CB_STOP);
+            case NLMSG_ERROR:
+                err = (const struct nlmsgerr*) mnl_nlmsg_get_payload(msg);
+                if (!err->error)
+                    return PyInt_FromLong(MNL_CB_STOP);
+                self->error = err->error;
+                return PyInt_FromLong(MNL_CB_ERROR);
+        }
+
+        if (NFNL_MSG_TYPE(msg->nlmsg_type) != NFT_MSG_NEWSETELEM)
+            continue;
+        if (_nf_nftnl_set_elems_parse(msg, _NetfilterDumpHandle_elem_cb, self) == MNL_CB_ERROR) {
+            PyErr_SetString(PyExc_OSError, "Call to realloc failed");
+            return NULL;
+        }
+    }
+
+    return PyInt_FromLong(MNL_CB_OK);
+}
+
+static PyObject* NetfilterDumpHandle_request (NetfilterDumpHandle* self) {
+    Py_INCREF(self->request);
+    return self->request;
+}
+
+static PyObject* NetfilterDumpHandle_clear (NetfilterDumpHandle* self) {
+    self->count = 0;
+    self->error = 0;
+    self->interrupted = 0;
+    self->keys.len = 0;
+    self->packets.len = 0;
+    self->bytes.len = 0;
+    self->consumed.len = 0;
+    self->connections.len = 0;
+    self->exprs.len = 0;
+    Py_RETURN_NONE;
+}
+
+static PyObject* _NetfilterDumpHandle_column (_nf_nftnl_column* column) {
+    return PyString_FromStringAndSize(column->data, (Py_ssize_t) column->len);
+}
+
+static PyObject* NetfilterDumpHandle_keys (NetfilterDumpHandle* self) {
+    return _NetfilterDumpHandle_column(&self->keys);
+}
+
+static PyObject* NetfilterDumpHandle_packets (NetfilterDumpHandle* self) {
+    return _NetfilterDumpHandle_column(&self->packets);
+}
+
+static PyObject* NetfilterDumpHandle_bytes (NetfilterDumpHandle* self) {
+    return _NetfilterDumpHandle_column(&self->bytes);
+}
+
+static PyObject* NetfilterDumpHandle_consumed (NetfilterDumpHandle* self) {
+    return _NetfilterDumpHandle_column(&self->consumed);
+}
+
+static PyObject* NetfilterDumpHandle_connections (NetfilterDumpHandle* self) {
+    return _NetfilterDumpHandle_column(&self->connections);
+}
+
+static PyObject* NetfilterDumpHandle_exprs (NetfilterDumpHandle* self) {
+    return _NetfilterDumpHandle_column(&self->exprs);
+}
+
+static PyObject* NetfilterDumpHandle_error (NetfilterDumpHandle* self) {
+    return PyInt_FromLong((long) self->error);
+}
+
+static PyObject* NetfilterDumpHandle_interrupted (NetfilterDumpHandle* self) {
+    return PyBool_FromLong((long) self->interrupted);
+}
+
+static Py_ssize_t NetfilterDumpHandle_len (NetfilterDumpHandle* self) {
+    return (Py_ssize_t) self->count;
+}
+
+static PyMemberDef NetfilterDumpHandle_members[] = {
+    {NULL}
+};
+
+static PyMethodDef NetfilterDumpHandle_methods[] = {
+    {"request", (PyCFunction) NetfilterDumpHandle_request, METH_NOARGS, NULL},
+    {"feed", (PyCFunction) NetfilterDumpHandle_feed, METH_VARARGS, NULL},
+    {"clear", (PyCFunction) NetfilterDumpHandle_clear, METH_NOARGS, NULL},
+    {"keys", (PyCFunction) NetfilterDumpHandle_keys, METH_NOARGS, NULL},
+    {"packets", (PyCFunction) NetfilterDumpHandle_packets, METH_NOARGS, NULL},
+    {"bytes", (PyCFunction) NetfilterDumpHandle_bytes, METH_NOARGS, NULL},
+    {"consumed", (PyCFunction) NetfilterDumpHandle_consumed, METH_NOARGS, NULL},
+    {"connections", (PyCFunction) NetfilterDumpHandle_connections, METH_NOARGS, NULL},
+    {"exprs", (PyCFunction) NetfilterDumpHandle_exprs, METH_NOARGS, NULL},
+    {"error", (PyCFunction) NetfilterDumpHandle_error, METH_NOARGS, NULL},
+    {"interrupted", (PyCFunction) NetfilterDumpHandle_interrupted, METH_NOARGS, NULL},
+    {NULL}
+};
+
+static PySequenceMethods NetfilterDumpHandle_as_sequence = {
+    (lenfunc) NetfilterDumpHandle_len,             /* sq_length */
+};
+
+static PyTypeObject NetfilterDumpHandleType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "libnftnlset.NetfilterDumpHandle",             /* tp_name */
+    sizeof(NetfilterDumpHandle),                   /* tp_basicsize */
+    0,                                             /* tp_itemsize */
+    (destructor) NetfilterDumpHandle_dealloc,      /* tp_dealloc */
+    0,                                             /* tp_print */
+    0,                                             /* tp_getattr */
+    0,                                             /* tp_setattr */
+    0,                                             /* tp_compare */
+    0,                                             /* tp_repr */
+    0,                                             /* tp_as_number */
+    &NetfilterDumpHandle_as_sequence,              /* tp_as_sequence */
+    0,                                             /* tp_as_mapping */
+    0,                                             /* tp_hash */
+    0,                                             /* tp_call */
+    0,                                             /* tp_str */
+    0,                                             /* tp_getattro */
+    0,                                             /* tp_setattro */
+    0,                                             /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,      /* tp_flags */
+    "Columnar GETSETELEM dump",                    /* tp_doc */
+    0,                                             /* tp_traverse */
+    0,                                             /* tp_clear */
+    0,                                             /* tp_richcompare */
+    0,                                             /* tp_weaklistoffset */
+    0,                                             /* tp_iter */
+    0,                                             /* tp_iternext */
+    NetfilterDumpHandle_methods,                   /* tp_methods */
+    NetfilterDumpHandle_members,                   /* tp_members */
+    0,                                             /* tp_getset */
+    0,                                             /* tp_base */
+    0,                                             /* tp_dict */
+    0,                                             /* tp_descr_get */
+    0,                                             /* tp_descr_set */
+    0,                                             /* tp_dictoffset */
+    (initproc) NetfilterDumpHandle_init,           /* tp_init */
+    0,                                             /* tp_alloc */
+    (newfunc) NetfilterDumpHandle_new,             /* tp_new */
+};
+
+// END: NetfilterDumpHandle
+
+// BEGIN: NetfilterPacerHandle
+
+/* A transaction handed out by the pacer and not acknowledged yet, with
+   the slice of the store it holds */
+typedef struct {
+    double sent; size_t start; size_t stop;
+} _nf_nftnl_inflight;
+
+/* A slice of the store whose transaction failed, to be handed out again */
+typedef struct {
+    size_t start; size_t stop;
+} _nf_nftnl_retry;
+
+/* Drains a store in transactions sized so that each commit holds the
+   nf_tables commit mutex for about `target` seconds. The cost of one
+   element is learnt from the acknowledgement latency of past commits,
+   and a token bucket caps how many commits are started per second. */
+typedef struct {
+    PyObject_HEAD
+    double target; double rate; double burst;
+    double tokens; double refilled;
+    double cost; double latency;
+    uint32_t size; uint32_t min_size; uint32_t max_size;
+    size_t offset;
+    _nf_nftnl_inflight* inflight; size_t inflight_head; size_t inflight_len; size_t inflight_cap;
+    _nf_nftnl_retry* retry; size_t retry_head; size_t retry_len; size_t retry_cap;
+} NetfilterPacerHandle;
+
+static double _nf_nftnl_now (void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static PyObject* NetfilterPacerHandle_new (PyTypeObject* type, PyTupleObject* args) {
+    NetfilterPacerHandle* self;
+    self = (NetfilterPacerHandle*) type->tp_alloc(type, 0);
+    self->target = 0;
+    self->rate = 0;
+    self->burst = 1;
+    self->tokens = 1;
+    self->refilled = _nf_nftnl_now();
+    self->cost = 0;
+    self->latency = 0;
+    self->size = 1;
+    self->min_size = 1;
+    self->max_size = 1;
+    self->offset = 0;
+    self->inflight = NULL;
+    self->inflight_head = 0;
+    self->inflight_len = 0;
+    self->inflight_cap = 0;
+    self->retry = NULL;
+    self->retry_head = 0;
+    self->retry_len = 0;
+    self->retry_cap = 0;
+    return (PyObject*) self;
+}
+
+static int NetfilterPacerHandle_init (NetfilterPacerHandle* self, PyTupleObject* args) {
+    return 0;
+}
+
+static void NetfilterPacerHandle_dealloc (NetfilterPacerHandle* self) {
+    free(self->inflight);
+    free(self->retry);
+    Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+static void _NetfilterPacerHandle_refill (NetfilterPacerHandle* self) {
+    double now = _nf_nftnl_now();
+    self->tokens += (now - self->refilled) * self->rate;
+    if (self->tokens > self->burst)
+        self->tokens = self->burst;
+    self->refilled = now;
+}
+
+static int _NetfilterPacerHandle_push (NetfilterPacerHandle* self, size_t start, size_t stop) {
+    _nf_nftnl_inflight* inflight; size_t cap;
+
+    if (self->inflight_head == self->inflight_len) {
+        self->inflight_head = 0;
+        self->inflight_len = 0;
+    }
+
+    if (self->inflight_len == self->inflight_cap) {
+        cap = self->inflight_cap ? self->inflight_cap * 2 : 16;
+        inflight = realloc(self->inflight, cap * sizeof(_nf_nftnl_inflight));
+        if (!inflight) {
+            PyErr_SetString(PyExc_OSError, "Call to realloc failed");
+            return -1;
+        }
+        self->inflight = inflight;
+        self->inflight_cap = cap;
+    }
+
+    self->inflight[self->inflight_len].sent = _nf_nftnl_now();
+    self->inflight[self->inflight_len].start = start;
+    self->inflight[self->inflight_len].stop = stop;
+    self->inflight_len++;
+    return 0;
+}
+
+static int _NetfilterPacerHandle_retry (NetfilterPacerHandle* self, size_t start, size_t stop) {
+    _nf_nftnl_retry* retry; size_t cap;
+
+    if (self->retry_head == self->retry_len) {
+        self->retry_head = 0;
+        self->retry_len = 0;
+    }
+
+    if (self->retry_len == self->retry_cap) {
+        cap = self->retry_cap ? self->retry_cap * 2 : 16;
+        retry = realloc(self->retry, cap * sizeof(_nf_nftnl_retry));
+        if (!retry) {
+            PyErr_SetString(PyExc_OSError, "Call to realloc failed");
+            return -1;
+        }
+        self->retry = retry;
+        self->retry_cap = cap;
+    }
+
+    self->retry[self->retry_len].start = start;
+    self->retry[self->retry_len].stop = stop;
+    self->retry_len++;
+    return 0;
+}
+
+static PyObject* NetfilterPacerHandle_next (NetfilterPacerHandle* self, PyTupleObject* args) {
+    NetfilterSetHandle* set; NetfilterStoreHandle* store;
+    PyObject* empty; PyObject* result; PyObject* delete = Py_False;
+    PyTupleObject* begin_args; NetfilterBatchHandle* batch;
+    uint16_t family; uint32_t bufsize;
+    size_t start; size_t stop; int retried; int keys_only; int len;
+
+    if (!PyArg_ParseTuple((PyObject*) args, "OOHI|O", &set, &store, &family, &bufsize, &delete)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, NetfilterStoreHandle store, uint16_t family, uint32_t bufsize, bool delete=False)");
+        return NULL;
+    }
+
+    if (!PyObject_IsInstance((PyObject*) set, (PyObject*) &NetfilterSetHandleType)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, NetfilterStoreHandle store, uint16_t family, uint32_t bufsize, bool delete=False)");
+        return NULL;
+    }
+
+    if (!PyObject_IsInstance((PyObject*) store, (PyObject*) &NetfilterStoreHandleType)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, NetfilterStoreHandle store, uint16_t family, uint32_t bufsize, bool delete=False)");
+        return NULL;
+    }
+
+    if (!PyBool_Check(delete)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, NetfilterStoreHandle store, uint16_t family, uint32_t bufsize, bool delete=False)");
+        return NULL;
+    }
+
+    /* Failed slices are handed out again before anything new */
+    retried = self->retry_head < self->retry_len;
+    if (retried) {
+        start = self->retry[self->retry_head].start;
+        stop = self->retry[self->retry_head].stop;
+    } else if (self->offset < store->count) {
+        start = self->offset;
+        stop = store->count;
+    } else
+        Py_RETURN_NONE;
+
+    if (self->rate > 0) {
+        _NetfilterPacerHandle_refill(self);
+        if (self->tokens < 1)
+            return PyString_FromStringAndSize(NULL, 0);
+    }
+
+    if (stop - start > self->size)
+        stop = start + self->size;
+    keys_only = PyObject_IsTrue(delete);
+
+    empty = PyTuple_New(0);
+    batch = (NetfilterBatchHandle*) PyObject_CallObject((PyObject*) &NetfilterBatchHandleType, empty);
+    Py_DECREF(empty);
+    if (!batch)
+        return NULL;
+
+    begin_args = (PyTupleObject*) Py_BuildValue("(I)", bufsize);
+    if (!begin_args) {
+        Py_DECREF(batch);
+        return NULL;
+    }
+    result = NetfilterBatchHandle_begin(batch, begin_args);
+    Py_DECREF(begin_args);
+    if (!result) {
+        Py_DECREF(batch);
+        return NULL;
+    }
+    Py_DECREF(result);
+
+    if (_NetfilterBatchHandle_store(batch, set, store, start, stop,
+                                    keys_only ? NFT_MSG_DELSETELEM : NFT_MSG_NEWSETELEM, family,
+                                    keys_only ? 0 : NLM_F_CREATE | NLM_F_REPLACE,
+                                    keys_only) < 0) {
+        Py_DECREF(batch);
+        return NULL;
+    }
+
+    result = NetfilterBatchHandle_end(batch);
+    if (!result) {
+        Py_DECREF(batch);
+        return NULL;
+    }
+    Py_DECREF(result);
+
+    result = NetfilterBatchHandle_dump(batch);
+    Py_DECREF(batch);
+    if (!result)
+        return NULL;
+
+    /* Errors are reported whatever the flags, so only the last message asks
+       for an acknowledgement and the transaction is answered by it */
+    len = (int) PyString_GET_SIZE(result);
+    _nf_nftnl_batch_last(PyString_AS_STRING(result), len);
+
+    if (_NetfilterPacerHandle_push(self, start, stop) < 0) {
+        Py_DECREF(result);
+        return NULL;
+    }
+
+    if (!retried)
+        self->offset = stop;
+    else if (stop < self->retry[self->retry_head].stop)
+        self->retry[self->retry_head].start = stop;
+    else
+        self->retry_head++;
+    if (self->rate > 0)
+        self->tokens -= 1;
+
+    return result;
+}
+
+/* Records the outcome of the oldest outstanding transaction. Unless the
+   latency is given, it is measured from the moment the transaction was
+   handed out. Successful commits update the per-element cost, and the
+   transaction size follows target / cost, growing at most twofold per
+   commit. Failed commits halve it, and only the failed slice is queued to
+   be handed out again, in smaller transactions. A slice that already fit
+   into min_size elements is given up on, and an OSError says which. */
+static PyObject* NetfilterPacerHandle_ack (NetfilterPacerHandle* self, PyTupleObject* args) {
+    int error; double latency = -1;
+    _nf_nftnl_inflight* inflight;
+    double sample; double size;
+    char message[96]; PyObject* exception;
+
+    if (!PyArg_ParseTuple((PyObject*) args, "i|d", &error, &latency)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (int error, double latency=-1)");
+        return NULL;
+    }
+
+    if (self->inflight_head == self->inflight_len) {
+        PyErr_SetString(PyExc_OSError, "No transaction is awaiting an acknowledgement");
+        return NULL;
+    }
+
+    inflight = &self->inflight[self->inflight_head++];
+    if (latency < 0)
+        latency = _nf_nftnl_now() - inflight->sent;
+
+    if (error) {
+        size = self->size / 2;
+    } else {
+        sample = latency / (inflight->stop - inflight->start);
+        self->cost = self->cost ? 0.75 * self->cost + 0.25 * sample : sample;
+        self->latency = self->latency ? 0.75 * self->latency + 0.25 * latency : latency;
+        size = self->cost > 0 ? self->target / self->cost : self->max_size;
+        if (size > 2.0 * self->size)
+            size = 2.0 * self->size;
+    }
+
+    if (size < self->min_size)
+        size = self->min_size;
+    if (size > self->max_size)
+        size = self->max_size;
+    self->size = (uint32_t) size;
+
+    if (error && inflight->stop - inflight->start <= self->min_size) {
+        snprintf(message, sizeof(message), "Transaction of elements %zu to %zu failed",
+                 inflight->start, inflight->stop);
+        exception = Py_BuildValue("(is)", -error, message);
+        if (exception) {
+            PyErr_SetObject(PyExc_OSError, exception);
+            Py_DECREF(exception);
+        }
+        return NULL;
+    }
+
+    if (error && _NetfilterPacerHandle_retry(self, inflight->start, inflight->stop) < 0)
+        return NULL;
+
+    return PyInt_FromLong((long) self->size);
+}
+
+static PyObject* NetfilterPacerHandle_delay (NetfilterPacerHandle* self) {
+    if (self->rate <= 0)
+        return PyFloat_FromDouble(0);
+
+    _NetfilterPacerHandle_refill(self);
+    if (self->tokens >= 1)
+        return PyFloat_FromDouble(0);
+    return PyFloat_FromDouble((1 - self->tokens) / self->rate);
+}
+
+static PyObject* NetfilterPacerHandle_reset (NetfilterPacerHandle* self) {
+    self->offset = 0;
+    self->inflight_head = 0;
+    self->inflight_len = 0;
+    self->retry_head = 0;
+    self->retry_len = 0;
+    Py_RETURN_NONE;
+}
+
+static PyObject* NetfilterPacerHandle_get_size (NetfilterPacerHandle* self, void* closure) {
+    return PyInt_FromLong((long) self->size);
+}
+
+static PyObject* NetfilterPacerHandle_get_offset (NetfilterPacerHandle* self, void* closure) {
+    return PyLong_FromSize_t(self->offset);
+}
+
+static PyObject* NetfilterPacerHandle_get_latency (NetfilterPacerHandle* self, void* closure) {
+    return PyFloat_FromDouble(self->latency);
+}
+
+static PyObject* NetfilterPacerHandle_get_inflight (NetfilterPacerHandle* self, void* closure) {
+    return PyLong_FromSize_t(self->inflight_len - self->inflight_head);
+}
+
+static PyObject* NetfilterPacerHandle_get_retrying (NetfilterPacerHandle* self, void* closure) {
+    size_t count = 0; size_t i;
+    for (i = self->retry_head; i < self->retry_len; i++)
+        count += self->retry[i].stop - self->retry[i].start;
+    return PyLong_FromSize_t(count);
+}
+
+static PyMemberDef NetfilterPacerHandle_members[] = {
+    {NULL}
+};
+
+static PyGetSetDef NetfilterPacerHandle_getset[] = {
+    {"size", (getter) NetfilterPacerHandle_get_size, NULL, NULL, NULL},
+    {"offset", (getter) NetfilterPacerHandle_get_offset, NULL, NULL, NULL},
+    {"latency", (getter) NetfilterPacerHandle_get_latency, NULL, NULL, NULL},
+    {"inflight", (getter) NetfilterPacerHandle_get_inflight, NULL, NULL, NULL},
+    {"retrying", (getter) NetfilterPacerHandle_get_retrying, NULL, NULL, NULL},
+    {NULL}
+};
+
+static PyMethodDef NetfilterPacerHandle_methods[] = {
+    {"next", (PyCFunction) NetfilterPacerHandle_next, METH_VARARGS, NULL},
+    {"ack", (PyCFunction) NetfilterPacerHandle_ack, METH_VARARGS, NULL},
+    {"delay", (PyCFunction) NetfilterPacerHandle_delay, METH_NOARGS, NULL},
+    {"reset", (PyCFunction) NetfilterPacerHandle_reset, METH_NOARGS, NULL},
+    {NULL}
+};
+
+static PyTypeObject NetfilterPacerHandleType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "libnftnlset.NetfilterPacerHandle",            /* tp_name */
+    sizeof(NetfilterPacerHandle),                  /* tp_basicsize */
+    0,                                             /* tp_itemsize */
+    (destructor) NetfilterPacerHandle_dealloc,     /* tp_dealloc */
+    0,                                             /* tp_print */
+    0,                                             /* tp_getattr */
+    0,                                             /* tp_setattr */
+    0,                                             /* tp_compare */
+    0,                                             /* tp_repr */
+    0,                                             /* tp_as_number */
+    0,                                             /* tp_as_sequence */
+    0,                                             /* tp_as_mapping */
+    0,                                             /* tp_hash */
+    0,                                             /* tp_call */
+    0,                                             /* tp_str */
+    0,                                             /* tp_getattro */
+    0,                                             /* tp_setattro */
+    0,                                             /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,      /* tp_flags */
+    "Latency-targeted commit pacing",              /* tp_doc */
+    0,                                             /* tp_traverse */
+    0,                                             /* tp_clear */
+    0,                                             /* tp_richcompare */
+    0,                                             /* tp_weaklistoffset */
+    0,                                             /* tp_iter */
+    0,                                             /* tp_iternext */
+    NetfilterPacerHandle_methods,                  /* tp_methods */
+    NetfilterPacerHandle_members,                  /* tp_members */
+    NetfilterPacerHandle_getset,                   /* tp_getset */
+    0,                                             /* tp_base */
+    0,                                             /* tp_dict */
+    0,                                             /* tp_descr_get */
+    0,                                             /* tp_descr_set */
+    0,                                             /* tp_dictoffset */
+    (initproc) NetfilterPacerHandle_init,          /* tp_init */
+    0,                                             /* tp_alloc */
+    (newfunc) NetfilterPacerHandle_new,            /* tp_new */
+};
+
+// END: NetfilterPacerHandle
+
+// BEGIN: NetfilterFanoutHandle
+
+/* One network namespace and the netfilter socket opened inside it.
+   `error` is set when the socket could not be opened, and is reported as
+   the outcome of every batch applied afterwards. */
+typedef struct {
+    int fd; int error; int result;
+} _nf_nftnl_netns;
+
+/* Work shared by the fan-out threads. Namespaces are claimed one at a time
+   from `next`, so a slow namespace does not hold up the others. */
+typedef struct _nf_nftnl_fanout {
+    _nf_nftnl_netns* netns; size_t count; size_t next;
+    void (*run) (struct _nf_nftnl_fanout* job, _nf_nftnl_netns* netns, char* buffer);
+    const int* nsfds; struct timeval timeout;
+    const char* data; size_t len;
+    uint32_t first; uint32_t last;
+} _nf_nftnl_fanout;
+
+typedef struct {
+    PyObject_HEAD
+    _nf_nftnl_netns* netns; size_t count;
+    uint32_t workers; uint32_t seq;
+} NetfilterFanoutHandle;
+
+/* Moves the calling thread into the namespace and opens a socket there.
+   Sockets stay in the namespace they were created in, whichever thread
+   uses them later. */
+static void _nf_nftnl_fanout_open (_nf_nftnl_fanout* job, _nf_nftnl_netns* netns, char* buffer) {
+    struct sockaddr_nl addr; int fd; int on = 1;
+    int nsfd = job->nsfds[netns - job->netns];
+
+    if (nsfd < 0)
+        return;
+    if (setns(nsfd, CLONE_NEWNET) < 0) {
+        netns->error = -errno;
+        return;
+    }
+
+    fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_NETFILTER);
+    if (fd < 0) {
+        netns->error = -errno;
+        return;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        netns->error = -errno;
+        close(fd);
+        return;
+    }
+
+    setsockopt(fd, SOL_NETLINK, NETLINK_CAP_ACK, &on, sizeof(on));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &job->timeout, sizeof(job->timeout));
+
+    netns->fd = fd;
+    netns->error = 0;
+}
+
+/* Sends the batch and waits until its last message is acknowledged, or
+   the batch is rejected as a whole on its begin message */
+static void _nf_nftnl_fanout_apply (_nf_nftnl_fanout* job, _nf_nftnl_netns* netns, char* buffer) {
+    const struct nlmsghdr* msg; const struct nlmsgerr* err;
+    ssize_t ret; int len;
+
+    netns->result = netns->error;
+    if (netns->fd < 0)
+        return;
+
+    _nf_nftnl_sndbuf(netns->fd, job->len);
+    if (send(netns->fd, job->data, job->len, 0) < 0) {
+        netns->result = -errno;
+        return;
+    }
+
+    for (;;) {
+        ret = recv(netns->fd, buffer, MNL_SOCKET_DUMP_SIZE, 0);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0) {
+            netns->result = (errno == EAGAIN || errno == EWOULDBLOCK) ? -ETIMEDOUT : -errno;
+            return;
+        }
+
+        len = (int) ret;
+        for (msg = (const struct nlmsghdr*) buffer; mnl_nlmsg_ok(msg, len); msg = mnl_nlmsg_next(msg, &len)) {
+            if (msg->nlmsg_type != NLMSG_ERROR)
+                continue;
+            /* Answers to an earlier batch that timed out are skipped */
+            if (msg->nlmsg_seq < job->first || msg->nlmsg_seq > job->last)
+                continue;
+            err = (const struct nlmsgerr*) mnl_nlmsg_get_payload(msg);
+            if (err->error && !netns->result)
+                netns->result = err->error;
+            if (msg->nlmsg_seq == job->last || (msg->nlmsg_seq == job->first && err->error))
+                return;
+        }
+    }
+}
+
+static void* _nf_nftnl_fanout_worker (void* arg) {
+    _nf_nftnl_fanout* job = (_nf_nftnl_fanout*) arg;
+    char* buffer = NULL; size_t i;
+
+    if (job->data) {
+        buffer = malloc(MNL_SOCKET_DUMP_SIZE);
+        if (!buffer)
+            return NULL;
+    }
+
+    while ((i = __sync_fetch_and_add(&job->next, 1)) < job->count)
+        job->run(job, &job->netns[i], buffer);
+
+    free(buffer);
+    return NULL;
+}
+
+/* Runs the job on up to `workers` threads. Must be called without holding
+   the GIL. Namespaces no thread got to keep the outcome they had. */
+static void _nf_nftnl_fanout_run (_nf_nftnl_fanout* job, uint32_t workers) {
+    pthread_t* threads; uint32_t i; uint32_t started;
+
+    if (workers > job->count)
+        workers = job->count;
+    if (!workers)
+        return;
+
+    threads = malloc(sizeof(pthread_t) * workers);
+    if (!threads)
+        return;
+
+    for (started = 0; started < workers; started++)
+        if (pthread_create(&threads[started], NULL, _nf_nftnl_fanout_worker, job))
+            break;
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    free(threads);
+}
+
+static PyObject* NetfilterFanoutHandle_new (PyTypeObject* type, PyTupleObject* args) {
+    NetfilterFanoutHandle* self;
+    self = (NetfilterFanoutHandle*) type->tp_alloc(type, 0);
+    self->netns = NULL;
+    self->count = 0;
+    self->workers = 1;
+    self->seq = time(NULL);
+    return (PyObject*) self;
+}
 
-    msg = nftnl_nlmsg_build_hdr(mnl_nlmsg_batch_current(self->handle),
-                                NFT_MSG_NEWSETELEM, family, flags,
-                                self->seq++);
-    nftnl_set_elems_nlmsg_build_payload(msg, set->handle);
-    mnl_nlmsg_batch_next(self->handle);
+static int NetfilterFanoutHandle_init (NetfilterFanoutHandle* self, PyTupleObject* args) {
+    return 0;
+}
+
+static void NetfilterFanoutHandle_dealloc (NetfilterFanoutHandle* self) {
+    size_t i;
+    for (i = 0; i < self->count; i++)
+        if (self->netns[i].fd >= 0) close(self->netns[i].fd);
+    free(self->netns);
+    Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+static PyObject* NetfilterFanoutHandle_apply (NetfilterFanoutHandle* self, PyTupleObject* args) {
+    _nf_nftnl_fanout job;
+    struct nlmsghdr* msg; struct nlmsghdr* last;
+    PyObject* results; PyObject* result;
+    char* data; char* batch; int datalen; int len;
+    size_t i;
+
+    if (!PyArg_ParseTuple((PyObject*) args, "s#", &data, &datalen)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (bytes batch)");
+        return NULL;
+    }
+
+    batch = malloc(datalen ? datalen : 1);
+    if (!batch) {
+        PyErr_SetString(PyExc_OSError, "Call to malloc failed");
+        return NULL;
+    }
+    memcpy(batch, data, datalen);
+
+    /* Renumbered on every call, so late answers to a batch that timed out
+       can never be taken for answers to this one */
+    memset(&job, 0, sizeof(job));
+    job.first = self->seq;
+    len = datalen;
+    for (msg = (struct nlmsghdr*) batch; mnl_nlmsg_ok(msg, len); msg = mnl_nlmsg_next(msg, &len))
+        msg->nlmsg_seq = self->seq++;
+
+    last = _nf_nftnl_batch_last(batch, datalen);
+    if (!last) {
+        free(batch);
+        self->seq = job.first;
+        PyErr_SetString(PyExc_ValueError, "Batch does not contain any message");
+        return NULL;
+    }
+
+    job.netns = self->netns;
+    job.count = self->count;
+    job.run = _nf_nftnl_fanout_apply;
+    job.data = batch;
+    job.len = datalen;
+    job.last = last->nlmsg_seq;
+
+    for (i = 0; i < self->count; i++)
+        self->netns[i].result = -EAGAIN;
+
+    Py_BEGIN_ALLOW_THREADS
+    _nf_nftnl_fanout_run(&job, self->workers);
+    Py_END_ALLOW_THREADS
+
+    free(batch);
+
+    results = PyList_New(self->count);
+    if (!results)
+        return NULL;
+    for (i = 0; i < self->count; i++) {
+        result = PyInt_FromLong((long) self->netns[i].result);
+        if (!result) {
+            Py_DECREF(results);
+            return NULL;
+        }
+        PyList_SET_ITEM(results, i, result);
+    }
+    return results;
+}
+
+static PyObject* NetfilterFanoutHandle_errors (NetfilterFanoutHandle* self) {
+    PyObject* results; PyObject* result;
+    size_t i;
+
+    results = PyList_New(self->count);
+    if (!results)
+        return NULL;
+    for (i = 0; i < self->count; i++) {
+        result = PyInt_FromLong((long) self->netns[i].error);
+        if (!result) {
+            Py_DECREF(results);
+            return NULL;
+        }
+        PyList_SET_ITEM(results, i, result);
+    }
+    return results;
+}
+
+static Py_ssize_t NetfilterFanoutHandle_len (NetfilterFanoutHandle* self) {
+    return (Py_ssize_t) self->count;
+}
+
+static PyMemberDef NetfilterFanoutHandle_members[] = {
+    {NULL}
+};
+
+static PyMethodDef NetfilterFanoutHandle_methods[] = {
+    {"apply", (PyCFunction) NetfilterFanoutHandle_apply, METH_VARARGS, NULL},
+    {"errors", (PyCFunction) NetfilterFanoutHandle_errors, METH_NOARGS, NULL},
+    {NULL}
+};
+
+static PySequenceMethods NetfilterFanoutHandle_as_sequence = {
+    (lenfunc) NetfilterFanoutHandle_len,           /* sq_length */
+};
+
+static PyTypeObject NetfilterFanoutHandleType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "libnftnlset.NetfilterFanoutHandle",           /* tp_name */
+    sizeof(NetfilterFanoutHandle),                 /* tp_basicsize */
+    0,                                             /* tp_itemsize */
+    (destructor) NetfilterFanoutHandle_dealloc,    /* tp_dealloc */
+    0,                                             /* tp_print */
+    0,                                             /* tp_getattr */
+    0,                                             /* tp_setattr */
+    0,                                             /* tp_compare */
+    0,                                             /* tp_repr */
+    0,                                             /* tp_as_number */
+    &NetfilterFanoutHandle_as_sequence,            /* tp_as_sequence */
+    0,                                             /* tp_as_mapping */
+    0,                                             /* tp_hash */
+    0,                                             /* tp_call */
+    0,                                             /* tp_str */
+    0,                                             /* tp_getattro */
+    0,                                             /* tp_setattro */
+    0,                                             /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,      /* tp_flags */
+    "Netfilter sockets across network namespaces", /* tp_doc */
+    0,                                             /* tp_traverse */
+    0,                                             /* tp_clear */
+    0,                                             /* tp_richcompare */
+    0,                                             /* tp_weaklistoffset */
+    0,                                             /* tp_iter */
+    0,                                             /* tp_iternext */
+    NetfilterFanoutHandle_methods,                 /* tp_methods */
+    NetfilterFanoutHandle_members,                 /* tp_members */
+    0,                                             /* tp_getset */
+    0,                                             /* tp_base */
+    0,                                             /* tp_dict */
+    0,                                             /* tp_descr_get */
+    0,                                             /* tp_descr_set */
+    0,                                             /* tp_dictoffset */
+    (initproc) NetfilterFanoutHandle_init,         /* tp_init */
+    0,                                             /* tp_alloc */
+    (newfunc) NetfilterFanoutHandle_new,           /* tp_new */
+};
+
+// END: NetfilterFanoutHandle
+
+// BEGIN: NetfilterEmulatorHandle
+
+/* Replies are cut into datagrams no larger than what callers usually
+   receive at once, like the kernel does for dumps */
+#define NF_NFTNL_EMU_DGRAM ((size_t) MNL_SOCKET_BUFFER_SIZE)
+
+typedef struct _nf_nftnl_emu_elem {
+    struct _nf_nftnl_emu_elem* next;
+    uint32_t hash; uint32_t flags;
+    uint64_t timeout; double deadline;
+    uint32_t data_len;
+    char key[];  /* key_len bytes of key, then data_len bytes of data */
+} _nf_nftnl_emu_elem;
+
+typedef struct _nf_nftnl_emu_set {
+    struct _nf_nftnl_emu_set* next;
+    uint16_t family; uint32_t id; uint64_t handle;
+    char table[NFT_TABLE_MAXNAMELEN]; char name[NFT_SET_MAXNAMELEN];
+    uint32_t key_len; uint32_t data_len; uint32_t flags; uint64_t timeout;
+    _nf_nftnl_emu_elem** buckets; uint32_t mask; size_t count;
+} _nf_nftnl_emu_set;
+
+typedef struct _nf_nftnl_emu_table {
+    struct _nf_nftnl_emu_table* next;
+    uint16_t family; char name[NFT_TABLE_MAXNAMELEN];
+} _nf_nftnl_emu_table;
+
+enum {
+    NF_NFTNL_EMU_UNDO_TABLE_ADD,
+    NF_NFTNL_EMU_UNDO_SET_ADD,
+    NF_NFTNL_EMU_UNDO_SET_DEL,
+    NF_NFTNL_EMU_UNDO_SET_FLUSH,
+    NF_NFTNL_EMU_UNDO_ELEM_ADD,
+    NF_NFTNL_EMU_UNDO_ELEM_REPLACE,
+    NF_NFTNL_EMU_UNDO_ELEM_DEL,
+};
+
+/* Transactions are applied in place and undone in reverse order when any
+   of their messages fails, the way the kernel aborts a batch */
+typedef struct _nf_nftnl_emu_undo {
+    struct _nf_nftnl_emu_undo* next;
+    int type;
+    _nf_nftnl_emu_table* table; _nf_nftnl_emu_set* set;
+    _nf_nftnl_emu_elem* elem; _nf_nftnl_emu_elem* old;
+    _nf_nftnl_emu_elem** buckets; uint32_t mask; size_t count;
+} _nf_nftnl_emu_undo;
+
+typedef struct {
+    char* data; size_t len; size_t cap;
+} _nf_nftnl_emu_out;
+
+/* Every connection is a socketpair of its own, so that replies only go to
+   the socket that asked. The serving thread owns the emulator's ends in
+   `peers`, and `wake` tells it that they changed or that it has to stop. */
+typedef struct {
+    PyObject_HEAD
+    int fd; int wake[2];
+    int* peers; size_t peers_len; size_t peers_cap;
+    pthread_t thread; int running; int stopping;
+    pthread_mutex_t lock;
+    double latency; double per_element;
+    uint32_t gen; uint64_t handle; uint64_t commits;
+    _nf_nftnl_emu_table* tables;
+    _nf_nftnl_emu_set* sets;
+    _nf_nftnl_emu_undo* undo;
+} NetfilterEmulatorHandle;
+
+static uint32_t _nf_nftnl_emu_hash (const char* key, uint32_t len) {
+    uint32_t hash = 2166136261u; uint32_t i;
+    for (i = 0; i < len; i++)
+        hash = (hash ^ (uint8_t) key[i]) * 16777619u;
+    return hash;
+}
+
+static void _nf_nftnl_emu_elems_free (_nf_nftnl_emu_elem** buckets, uint32_t mask) {
+    _nf_nftnl_emu_elem* elem; _nf_nftnl_emu_elem* next;
+    uint32_t i;
+    if (!buckets)
+        return;
+    for (i = 0; i <= mask; i++)
+        for (elem = buckets[i]; elem; elem = next) {
+            next = elem->next;
+            free(elem);
+        }
+    free(buckets);
+}
+
+static void _nf_nftnl_emu_set_free (_nf_nftnl_emu_set* set) {
+    _nf_nftnl_emu_elems_free(set->buckets, set->mask);
+    free(set);
+}
+
+static int _nf_nftnl_emu_set_link (_nf_nftnl_emu_set* set, _nf_nftnl_emu_elem* elem) {
+    _nf_nftnl_emu_elem** buckets; _nf_nftnl_emu_elem* item; _nf_nftnl_emu_elem* next;
+    uint32_t mask; uint32_t i;
+
+    if (!set->buckets || set->count > set->mask) {
+        mask = set->buckets ? set->mask * 2 + 1 : 63;
+        buckets = calloc(mask + 1, sizeof(_nf_nftnl_emu_elem*));
+        if (!buckets)
+            return -ENOMEM;
+        for (i = 0; set->buckets && i <= set->mask; i++)
+            for (item = set->buckets[i]; item; item = next) {
+                next = item->next;
+                item->next = buckets[item->hash & mask];
+                buckets[item->hash & mask] = item;
+            }
+        free(set->buckets);
+        set->buckets = buckets;
+        set->mask = mask;
+    }
+
+    elem->next = set->buckets[elem->hash & set->mask];
+    set->buckets[elem->hash & set->mask] = elem;
+    set->count++;
+    return 0;
+}
+
+static void _nf_nftnl_emu_set_unlink (_nf_nftnl_emu_set* set, _nf_nftnl_emu_elem* elem) {
+    _nf_nftnl_emu_elem** link;
+    for (link = &set->buckets[elem->hash & set->mask]; *link; link = &(*link)->next)
+        if (*link == elem) {
+            *link = elem->next;
+            set->count--;
+            return;
+        }
+}
+
+/* Expired elements are still found, since adding the key again replaces
+   them; callers treat them as absent */
+static _nf_nftnl_emu_elem* _nf_nftnl_emu_set_find (_nf_nftnl_emu_set* set, const char* key) {
+    _nf_nftnl_emu_elem* elem; uint32_t hash;
+    if (!set->buckets)
+        return NULL;
+    hash = _nf_nftnl_emu_hash(key, set->key_len);
+    for (elem = set->buckets[hash & set->mask]; elem; elem = elem->next)
+        if (elem->hash == hash && !memcmp(elem->key, key, set->key_len))
+            return elem;
+    return NULL;
+}
+
+static int _nf_nftnl_emu_expired (_nf_nftnl_emu_elem* elem, double now) {
+    return elem->deadline && elem->deadline <= now;
+}
+
+static _nf_nftnl_emu_table* _NetfilterEmulatorHandle_table (NetfilterEmulatorHandle* self, uint16_t family, const char* name) {
+    _nf_nftnl_emu_table* table;
+    for (table = self->tables; table; table = table->next)
+        if (table->family == family && !strcmp(table->name, name))
+            return table;
+    return NULL;
+}
+
+static _nf_nftnl_emu_set* _NetfilterEmulatorHandle_set (NetfilterEmulatorHandle* self, uint16_t family,
+                                                        const char* table, const char* name, const uint32_t* id) {
+    _nf_nftnl_emu_set* set;
+    for (set = self->sets; set; set = set->next)
+        if (set->family == family && !strcmp(set->table, table) &&
+            (name ? !strcmp(set->name, name) : id && set->id == *id))
+            return set;
+    return NULL;
+}
+
+static int _NetfilterEmulatorHandle_journal (NetfilterEmulatorHandle* self, int type, _nf_nftnl_emu_table* table,
+                                             _nf_nftnl_emu_set* set, _nf_nftnl_emu_elem* elem, _nf_nftnl_emu_elem* old) {
+    _nf_nftnl_emu_undo* undo = calloc(1, sizeof(_nf_nftnl_emu_undo));
+    if (!undo)
+        return -ENOMEM;
+    undo->type = type;
+    undo->table = table;
+    undo->set = set;
+    undo->elem = elem;
+    undo->old = old;
+    undo->next = self->undo;
+    self->undo = undo;
+    return 0;
+}
+
+static void _NetfilterEmulatorHandle_unlink_set (NetfilterEmulatorHandle* self, _nf_nftnl_emu_set* set) {
+    _nf_nftnl_emu_set** link;
+    for (link = &self->sets; *link; link = &(*link)->next)
+        if (*link == set) {
+            *link = set->next;
+            return;
+        }
+}
+
+/* Ends a transaction. On commit, whatever it replaced or deleted is freed
+   and the generation moves on. On abort, every change is undone. */
+static void _NetfilterEmulatorHandle_finish (NetfilterEmulatorHandle* self, int commit) {
+    _nf_nftnl_emu_undo* undo; _nf_nftnl_emu_table** link;
+
+    while ((undo = self->undo)) {
+        self->undo = undo->next;
+        if (commit) {
+            switch (undo->type) {
+                case NF_NFTNL_EMU_UNDO_SET_DEL:
+                    _nf_nftnl_emu_set_free(undo->set);
+                    break;
+                case NF_NFTNL_EMU_UNDO_SET_FLUSH:
+                    _nf_nftnl_emu_elems_free(undo->buckets, undo->mask);
+                    break;
+                case NF_NFTNL_EMU_UNDO_ELEM_REPLACE:
+                case NF_NFTNL_EMU_UNDO_ELEM_DEL:
+                    free(undo->old);
+                    break;
+            }
+        } else {
+            switch (undo->type) {
+                case NF_NFTNL_EMU_UNDO_TABLE_ADD:
+                    for (link = &self->tables; *link; link = &(*link)->next)
+                        if (*link == undo->table) {
+                            *link = undo->table->next;
+                            break;
+                        }
+                    free(undo->table);
+                    break;
+                case NF_NFTNL_EMU_UNDO_SET_ADD:
+                    _NetfilterEmulatorHandle_unlink_set(self, undo->set);
+                    _nf_nftnl_emu_set_free(undo->set);
+                    break;
+                case NF_NFTNL_EMU_UNDO_SET_DEL:
+                    undo->set->next = self->sets;
+                    self->sets = undo->set;
+                    break;
+                case NF_NFTNL_EMU_UNDO_SET_FLUSH:
+                    _nf_nftnl_emu_elems_free(undo->set->buckets, undo->set->mask);
+                    undo->set->buckets = undo->buckets;
+                    undo->set->mask = undo->mask;
+                    undo->set->count = undo->count;
+                    break;
+                case NF_NFTNL_EMU_UNDO_ELEM_ADD:
+                    _nf_nftnl_emu_set_unlink(undo->set, undo->elem);
+                    free(undo->elem);
+                    break;
+                case NF_NFTNL_EMU_UNDO_ELEM_REPLACE:
+                    _nf_nftnl_emu_set_unlink(undo->set, undo->elem);
+                    free(undo->elem);
+                    /* Relinking never allocates: the old element just left */
+                    _nf_nftnl_emu_set_link(undo->set, undo->old);
+                    break;
+                case NF_NFTNL_EMU_UNDO_ELEM_DEL:
+                    _nf_nftnl_emu_set_link(undo->set, undo->old);
+                    break;
+            }
+        }
+        free(undo);
+    }
+
+    if (commit)
+        self->gen++;
+}
+
+static char* _nf_nftnl_emu_out_reserve (_nf_nftnl_emu_out* out) {
+    size_t cap; char* data;
+    if (out->len + 2 * NF_NFTNL_EMU_DGRAM > out->cap) {
+        cap = out->cap ? out->cap * 2 : 4 * NF_NFTNL_EMU_DGRAM;
+        data = realloc(out->data, cap);
+        if (!data)
+            return NULL;
+        out->data = data;
+        out->cap = cap;
+    }
+    return out->data + out->len;
+}
+
+static struct nlmsghdr* _nf_nftnl_emu_reply (_nf_nftnl_emu_out* out, const struct nlmsghdr* req,
+                                             uint16_t type, uint16_t flags, uint16_t family, uint32_t gen) {
+    struct nlmsghdr* msg; struct nfgenmsg* nfg;
+    char* buffer = _nf_nftnl_emu_out_reserve(out);
+    if (!buffer)
+        return NULL;
+    msg = mnl_nlmsg_put_header(buffer);
+    msg->nlmsg_type = (NFNL_SUBSYS_NFTABLES << 8) | type;
+    msg->nlmsg_flags = flags;
+    msg->nlmsg_seq = req->nlmsg_seq;
+    msg->nlmsg_pid = req->nlmsg_pid;
+    nfg = mnl_nlmsg_put_extra_header(msg, sizeof(struct nfgenmsg));
+    nfg->nfgen_family = family;
+    nfg->version = NFNETLINK_V0;
+    nfg->res_id = htons(gen & 0xffff);
+    return msg;
+}
+
+static void _nf_nftnl_emu_commit (_nf_nftnl_emu_out* out, struct nlmsghdr* msg) {
+    out->len += MNL_ALIGN(msg->nlmsg_len);
+}
+
+static int _nf_nftnl_emu_ack (_nf_nftnl_emu_out* out, const struct nlmsghdr* req, int error) {
+    struct nlmsghdr* msg; struct nlmsgerr* err;
+    char* buffer = _nf_nftnl_emu_out_reserve(out);
+    if (!buffer)
+        return -ENOMEM;
+    msg = mnl_nlmsg_put_header(buffer);
+    msg->nlmsg_type = NLMSG_ERROR;
+    msg->nlmsg_seq = req->nlmsg_seq;
+    msg->nlmsg_pid = req->nlmsg_pid;
+    /* Only the header is echoed, as with NETLINK_CAP_ACK */
+    err = mnl_nlmsg_put_extra_header(msg, sizeof(struct nlmsgerr));
+    err->error = error;
+    memcpy(&err->msg, req, sizeof(struct nlmsghdr));
+    _nf_nftnl_emu_commit(out, msg);
+    return 0;
+}
+
+static int _nf_nftnl_emu_done (_nf_nftnl_emu_out* out, const struct nlmsghdr* req) {
+    struct nlmsghdr* msg; int* status;
+    char* buffer = _nf_nftnl_emu_out_reserve(out);
+    if (!buffer)
+        return -ENOMEM;
+    msg = mnl_nlmsg_put_header(buffer);
+    msg->nlmsg_type = NLMSG_DONE;
+    msg->nlmsg_flags = NLM_F_MULTI;
+    msg->nlmsg_seq = req->nlmsg_seq;
+    msg->nlmsg_pid = req->nlmsg_pid;
+    status = mnl_nlmsg_put_extra_header(msg, sizeof(int));
+    *status = 0;
+    _nf_nftnl_emu_commit(out, msg);
+    return 0;
+}
+
+static void _nf_nftnl_emu_elem_put (struct nlmsghdr* msg, _nf_nftnl_emu_set* set,
+                                    _nf_nftnl_emu_elem* elem, double now) {
+    struct nlattr* nest1; struct nlattr* nest2;
+    uint64_t expiration;
+
+    nest1 = mnl_attr_nest_start(msg, NFTA_LIST_ELEM);
+    if (elem->flags)
+        mnl_attr_put_u32(msg, NFTA_SET_ELEM_FLAGS, htonl(elem->flags));
+    if (elem->timeout) {
+        mnl_attr_put_u64(msg, NFTA_SET_ELEM_TIMEOUT, htobe64(elem->timeout));
+        expiration = elem->deadline > now ? (uint64_t) ((elem->deadline - now) * 1000) : 0;
+        mnl_attr_put_u64(msg, NFTA_SET_ELEM_EXPIRATION, htobe64(expiration));
+    }
+    nest2 = mnl_attr_nest_start(msg, NFTA_SET_ELEM_KEY);
+    mnl_attr_put(msg, NFTA_DATA_VALUE, set->key_len, elem->key);
+    mnl_attr_nest_end(msg, nest2);
+    if (elem->data_len) {
+        nest2 = mnl_attr_nest_start(msg, NFTA_SET_ELEM_DATA);
+        mnl_attr_put(msg, NFTA_DATA_VALUE, elem->data_len, elem->key + set->key_len);
+        mnl_attr_nest_end(msg, nest2);
+    }
+    mnl_attr_nest_end(msg, nest1);
+}
+
+/* The attributes of a request, indexed by type */
+static void _nf_nftnl_emu_parse (const struct nlmsghdr* msg, const struct nlattr** tb, uint16_t max) {
+    const struct nlattr* attr; uint16_t type;
+    memset(tb, 0, sizeof(struct nlattr*) * (max + 1));
+    mnl_attr_for_each(attr, msg, sizeof(struct nfgenmsg)) {
+        type = mnl_attr_get_type(attr);
+        if (type <= max) tb[type] = attr;
+    }
+}
+
+static uint16_t _nf_nftnl_emu_family (const struct nlmsghdr* msg) {
+    return ((const struct nfgenmsg*) mnl_nlmsg_get_payload(msg))->nfgen_family;
+}
+
+static int _NetfilterEmulatorHandle_newtable (NetfilterEmulatorHandle* self, const struct nlmsghdr* msg) {
+    const struct nlattr* tb[NFTA_TABLE_MAX + 1];
+    _nf_nftnl_emu_table* table; uint16_t family = _nf_nftnl_emu_family(msg);
+
+    _nf_nftnl_emu_parse(msg, tb, NFTA_TABLE_MAX);
+    if (!tb[NFTA_TABLE_NAME] || mnl_attr_get_payload_len(tb[NFTA_TABLE_NAME]) > NFT_TABLE_MAXNAMELEN)
+        return -EINVAL;
+
+    if (_NetfilterEmulatorHandle_table(self, family, mnl_attr_get_str(tb[NFTA_TABLE_NAME])))
+        return (msg->nlmsg_flags & NLM_F_EXCL) ? -EEXIST : 0;
+
+    table = calloc(1, sizeof(_nf_nftnl_emu_table));
+    if (!table)
+        return -ENOMEM;
+    table->family = family;
+    strncpy(table->name, mnl_attr_get_str(tb[NFTA_TABLE_NAME]), NFT_TABLE_MAXNAMELEN - 1);
+    table->next = self->tables;
+    self->tables = table;
+    return _NetfilterEmulatorHandle_journal(self, NF_NFTNL_EMU_UNDO_TABLE_ADD, table, NULL, NULL, NULL);
+}
+
+static int _NetfilterEmulatorHandle_newset (NetfilterEmulatorHandle* self, const struct nlmsghdr* msg) {
+    const struct nlattr* tb[NFTA_SET_MAX + 1];
+    _nf_nftnl_emu_set* set; uint16_t family = _nf_nftnl_emu_family(msg);
+    uint32_t key_len; uint32_t data_len; uint32_t flags;
+
+    _nf_nftnl_emu_parse(msg, tb, NFTA_SET_MAX);
+    if (!tb[NFTA_SET_TABLE] || !tb[NFTA_SET_NAME] || !tb[NFTA_SET_KEY_LEN] ||
+        mnl_attr_get_payload_len(tb[NFTA_SET_NAME]) > NFT_SET_MAXNAMELEN)
+        return -EINVAL;
+    if (!_NetfilterEmulatorHandle_table(self, family, mnl_attr_get_str(tb[NFTA_SET_TABLE])))
+        return -ENOENT;
+
+    key_len = ntohl(mnl_attr_get_u32(tb[NFTA_SET_KEY_LEN]));
+    data_len = tb[NFTA_SET_DATA_LEN] ? ntohl(mnl_attr_get_u32(tb[NFTA_SET_DATA_LEN])) : 0;
+    flags = tb[NFTA_SET_FLAGS] ? ntohl(mnl_attr_get_u32(tb[NFTA_SET_FLAGS])) : 0;
+    if (!key_len || key_len > NFT_DATA_VALUE_MAXLEN || data_len > NFT_DATA_VALUE_MAXLEN)
+        return -EINVAL;
+
+    set = _NetfilterEmulatorHandle_set(self, family, mnl_attr_get_str(tb[NFTA_SET_TABLE]),
+                                       mnl_attr_get_str(tb[NFTA_SET_NAME]), NULL);
+    if (set) {
+        if (msg->nlmsg_flags & NLM_F_EXCL)
+            return -EEXIST;
+        return (set->key_len != key_len || set->data_len != data_len) ? -EEXIST : 0;
+    }
+
+    set = calloc(1, sizeof(_nf_nftnl_emu_set));
+    if (!set)
+        return -ENOMEM;
+    set->family = family;
+    set->handle = ++self->handle;
+    set->id = tb[NFTA_SET_ID] ? ntohl(mnl_attr_get_u32(tb[NFTA_SET_ID])) : 0;
+    strncpy(set->table, mnl_attr_get_str(tb[NFTA_SET_TABLE]), NFT_TABLE_MAXNAMELEN - 1);
+    strncpy(set->name, mnl_attr_get_str(tb[NFTA_SET_NAME]), NFT_SET_MAXNAMELEN - 1);
+    set->key_len = key_len;
+    set->data_len = (flags & NFT_SET_MAP) ? data_len : 0;
+    set->flags = flags;
+    set->timeout = tb[NFTA_SET_TIMEOUT] ? be64toh(mnl_attr_get_u64(tb[NFTA_SET_TIMEOUT])) : 0;
+    set->next = self->sets;
+    self->sets = set;
+    return _NetfilterEmulatorHandle_journal(self, NF_NFTNL_EMU_UNDO_SET_ADD, NULL, set, NULL, NULL);
+}
+
+static int _NetfilterEmulatorHandle_delset (NetfilterEmulatorHandle* self, const struct nlmsghdr* msg) {
+    const struct nlattr* tb[NFTA_SET_MAX + 1];
+    _nf_nftnl_emu_set* set;
+
+    _nf_nftnl_emu_parse(msg, tb, NFTA_SET_MAX);
+    if (!tb[NFTA_SET_TABLE] || !tb[NFTA_SET_NAME])
+        return -EINVAL;
+
+    set = _NetfilterEmulatorHandle_set(self, _nf_nftnl_emu_family(msg), mnl_attr_get_str(tb[NFTA_SET_TABLE]),
+                                       mnl_attr_get_str(tb[NFTA_SET_NAME]), NULL);
+    if (!set)
+        return -ENOENT;
+
+    _NetfilterEmulatorHandle_unlink_set(self, set);
+    return _NetfilterEmulatorHandle_journal(self, NF_NFTNL_EMU_UNDO_SET_DEL, NULL, set, NULL, NULL);
+}
+
+static _nf_nftnl_emu_set* _NetfilterEmulatorHandle_elem_set (NetfilterEmulatorHandle* self, const struct nlmsghdr* msg,
+                                                             const struct nlattr** tb) {
+    uint32_t id;
+    if (!tb[NFTA_SET_ELEM_LIST_TABLE])
+        return NULL;
+    if (tb[NFTA_SET_ELEM_LIST_SET])
+        return _NetfilterEmulatorHandle_set(self, _nf_nftnl_emu_family(msg), mnl_attr_get_str(tb[NFTA_SET_ELEM_LIST_TABLE]),
+                                            mnl_attr_get_str(tb[NFTA_SET_ELEM_LIST_SET]), NULL);
+    if (tb[NFTA_SET_ELEM_LIST_SET_ID]) {
+        id = ntohl(mnl_attr_get_u32(tb[NFTA_SET_ELEM_LIST_SET_ID]));
+        return _NetfilterEmulatorHandle_set(self, _nf_nftnl_emu_family(msg), mnl_attr_get_str(tb[NFTA_SET_ELEM_LIST_TABLE]),
+                                            NULL, &id);
+    }
+    return NULL;
+}
+
+/* Adds or removes every element of a NEWSETELEM/DELSETELEM message, and
+   counts them towards the injected per-element latency */
+static int _NetfilterEmulatorHandle_setelem (NetfilterEmulatorHandle* self, const struct nlmsghdr* msg,
+                                             int add, size_t* touched) {
+    const struct nlattr* tb[NFTA_SET_ELEM_LIST_MAX + 1];
+    const struct nlattr* etb[NFTA_SET_ELEM_MAX + 1];
+    const struct nlattr* attr; const struct nlattr* key; const struct nlattr* data;
+    _nf_nftnl_emu_set* set; _nf_nftnl_emu_elem* elem; _nf_nftnl_emu_elem* old;
+    _nf_nftnl_emu_undo* undo;
+    double now = _nf_nftnl_now();
+    uint32_t data_len; uint64_t timeout; int expired; int ret;
+
+    _nf_nftnl_emu_parse(msg, tb, NFTA_SET_ELEM_LIST_MAX);
+    /* The kernel refuses a NEWSETELEM without elements before it even
+       looks the set up */
+    if (add && !tb[NFTA_SET_ELEM_LIST_ELEMENTS])
+        return -EINVAL;
+
+    set = _NetfilterEmulatorHandle_elem_set(self, msg, tb);
+    if (!set)
+        return -ENOENT;
+
+    if (!tb[NFTA_SET_ELEM_LIST_ELEMENTS]) {
+        /* A DELSETELEM without elements flushes the set */
+        ret = _NetfilterEmulatorHandle_journal(self, NF_NFTNL_EMU_UNDO_SET_FLUSH, NULL, set, NULL, NULL);
+        if (ret < 0)
+            return ret;
+        undo = self->undo;
+        undo->buckets = set->buckets;
+        undo->mask = set->mask;
+        undo->count = set->count;
+        set->buckets = NULL;
+        set->mask = 0;
+        set->count = 0;
+        return 0;
+    }
+
+    mnl_attr_for_each_nested(attr, tb[NFTA_SET_ELEM_LIST_ELEMENTS]) {
+        _nf_nftnl_attr_parse_nested(attr, etb, NFTA_SET_ELEM_MAX);
+        key = _nf_nftnl_attr_data_value(etb[NFTA_SET_ELEM_KEY]);
+        if (!key || mnl_attr_get_payload_len(key) != set->key_len)
+            return -EINVAL;
+        (*touched)++;
+
+        old = _nf_nftnl_emu_set_find(set, mnl_attr_get_payload(key));
+        expired = old && _nf_nftnl_emu_expired(old, now);
+        if (!add) {
+            if (!old || expired)
+                return -ENOENT;
+            _nf_nftnl_emu_set_unlink(set, old);
+            ret = _NetfilterEmulatorHandle_journal(self, NF_NFTNL_EMU_UNDO_ELEM_DEL, NULL, set, NULL, old);
+            if (ret < 0) {
+                _nf_nftnl_emu_set_link(set, old);
+                return ret;
+            }
+            continue;
+        }
+
+        if (old && !expired && (msg->nlmsg_flags & NLM_F_EXCL))
+            return -EEXIST;
+
+        /* Only maps carry data, and then every element does */
+        data = _nf_nftnl_attr_data_value(etb[NFTA_SET_ELEM_DATA]);
+        data_len = data ? mnl_attr_get_payload_len(data) : 0;
+        if ((set->flags & NFT_SET_MAP) ? !data || data_len != set->data_len : etb[NFTA_SET_ELEM_DATA] != NULL)
+            return -EINVAL;
+
+        /* Elements without a timeout of their own get the set's default */
+        if (etb[NFTA_SET_ELEM_TIMEOUT] && !(set->flags & NFT_SET_TIMEOUT))
+            return -EINVAL;
+        timeout = etb[NFTA_SET_ELEM_TIMEOUT] ? be64toh(mnl_attr_get_u64(etb[NFTA_SET_ELEM_TIMEOUT])) :
+                  (set->flags & NFT_SET_TIMEOUT) ? set->timeout : 0;
+
+        elem = malloc(sizeof(_nf_nftnl_emu_elem) + set->key_len + data_len);
+        if (!elem)
+            return -ENOMEM;
+        elem->hash = _nf_nftnl_emu_hash(mnl_attr_get_payload(key), set->key_len);
+        elem->flags = etb[NFTA_SET_ELEM_FLAGS] ? ntohl(mnl_attr_get_u32(etb[NFTA_SET_ELEM_FLAGS])) : 0;
+        elem->timeout = timeout;
+        elem->deadline = timeout ? now + timeout / 1000.0 : 0;
+        elem->data_len = data_len;
+        memcpy(elem->key, mnl_attr_get_payload(key), set->key_len);
+        if (data)
+            memcpy(elem->key + set->key_len, mnl_attr_get_payload(data), data_len);
+
+        if (old)
+            _nf_nftnl_emu_set_unlink(set, old);
+        ret = _nf_nftnl_emu_set_link(set, elem);
+        if (ret == 0)
+            ret = _NetfilterEmulatorHandle_journal(self, old ? NF_NFTNL_EMU_UNDO_ELEM_REPLACE : NF_NFTNL_EMU_UNDO_ELEM_ADD,
+                                                   NULL, set, elem, old);
+        if (ret < 0) {
+            _nf_nftnl_emu_set_unlink(set, elem);
+            free(elem);
+            if (old)
+                _nf_nftnl_emu_set_link(set, old);
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+static int _NetfilterEmulatorHandle_getsetelem (NetfilterEmulatorHandle* self, const struct nlmsghdr* req,
+                                                _nf_nftnl_emu_out* out) {
+    const struct nlattr* tb[NFTA_SET_ELEM_LIST_MAX + 1];
+    const struct nlattr* etb[NFTA_SET_ELEM_MAX + 1];
+    const struct nlattr* attr; const struct nlattr* key;
+    struct nlmsghdr* msg = NULL; struct nlattr* nest = NULL;
+    _nf_nftnl_emu_set* set; _nf_nftnl_emu_elem* elem;
+    uint16_t family = _nf_nftnl_emu_family(req);
+    double now = _nf_nftnl_now();
+    uint32_t i; uint32_t elem_max;
+
+    _nf_nftnl_emu_parse(req, tb, NFTA_SET_ELEM_LIST_MAX);
+    set = _NetfilterEmulatorHandle_elem_set(self, req, tb);
+    if (!set)
+        return -ENOENT;
+
+    /* Like the kernel, every element asked for is answered in a message of
+       its own, up to the first one that is missing */
+    if (!(req->nlmsg_flags & NLM_F_DUMP)) {
+        if (!tb[NFTA_SET_ELEM_LIST_ELEMENTS])
+            return -EINVAL;
+        mnl_attr_for_each_nested(attr, tb[NFTA_SET_ELEM_LIST_ELEMENTS]) {
+            _nf_nftnl_attr_parse_nested(attr, etb, NFTA_SET_ELEM_MAX);
+            key = _nf_nftnl_attr_data_value(etb[NFTA_SET_ELEM_KEY]);
+            if (!key || mnl_attr_get_payload_len(key) != set->key_len)
+                return -EINVAL;
+            elem = _nf_nftnl_emu_set_find(set, mnl_attr_get_payload(key));
+            if (!elem || _nf_nftnl_emu_expired(elem, now))
+                return -ENOENT;
+
+            msg = _nf_nftnl_emu_reply(out, req, NFT_MSG_NEWSETELEM, 0, family, self->gen);
+            if (!msg)
+                return -ENOMEM;
+            mnl_attr_put_strz(msg, NFTA_SET_ELEM_LIST_TABLE, set->table);
+            mnl_attr_put_strz(msg, NFTA_SET_ELEM_LIST_SET, set->name);
+            nest = mnl_attr_nest_start(msg, NFTA_SET_ELEM_LIST_ELEMENTS);
+            _nf_nftnl_emu_elem_put(msg, set, elem, now);
+            mnl_attr_nest_end(msg, nest);
+            _nf_nftnl_emu_commit(out, msg);
+        }
+        return 0;
+    }
+
+    elem_max = 128 + MNL_ALIGN(set->key_len) + MNL_ALIGN(set->data_len);
+    for (i = 0; set->buckets && i <= set->mask; i++)
+        for (elem = set->buckets[i]; elem; elem = elem->next) {
+            if (_nf_nftnl_emu_expired(elem, now))
+                continue;
+            if (msg && msg->nlmsg_len + elem_max > NF_NFTNL_EMU_DGRAM) {
+                mnl_attr_nest_end(msg, nest);
+                _nf_nftnl_emu_commit(out, msg);
+                msg = NULL;
+            }
+            if (!msg) {
+                msg = _nf_nftnl_emu_reply(out, req, NFT_MSG_NEWSETELEM, NLM_F_MULTI, family, self->gen);
+                if (!msg)
+                    return -ENOMEM;
+                mnl_attr_put_strz(msg, NFTA_SET_ELEM_LIST_TABLE, set->table);
+                mnl_attr_put_strz(msg, NFTA_SET_ELEM_LIST_SET, set->name);
+                nest = mnl_attr_nest_start(msg, NFTA_SET_ELEM_LIST_ELEMENTS);
+            }
+            _nf_nftnl_emu_elem_put(msg, set, elem, now);
+        }
+
+    if (msg) {
+        mnl_attr_nest_end(msg, nest);
+        _nf_nftnl_emu_commit(out, msg);
+    }
+    return _nf_nftnl_emu_done(out, req);
+}
+
+static int _NetfilterEmulatorHandle_getset (NetfilterEmulatorHandle* self, const struct nlmsghdr* req,
+                                            _nf_nftnl_emu_out* out) {
+    const struct nlattr* tb[NFTA_SET_MAX + 1];
+    struct nlmsghdr* msg; _nf_nftnl_emu_set* set;
+    uint16_t family = _nf_nftnl_emu_family(req);
+
+    _nf_nftnl_emu_parse(req, tb, NFTA_SET_MAX);
+    for (set = self->sets; set; set = set->next) {
+        if (family != NFPROTO_UNSPEC && set->family != family)
+            continue;
+        if (tb[NFTA_SET_TABLE] && strcmp(set->table, mnl_attr_get_str(tb[NFTA_SET_TABLE])))
+            continue;
+        if (!(req->nlmsg_flags & NLM_F_DUMP) &&
+            (!tb[NFTA_SET_NAME] || strcmp(set->name, mnl_attr_get_str(tb[NFTA_SET_NAME]))))
+            continue;
+
+        msg = _nf_nftnl_emu_reply(out, req, NFT_MSG_NEWSET, (req->nlmsg_flags & NLM_F_DUMP) ? NLM_F_MULTI : 0,
+                                  set->family, self->gen);
+        if (!msg)
+            return -ENOMEM;
+        mnl_attr_put_strz(msg, NFTA_SET_TABLE, set->table);
+        mnl_attr_put_strz(msg, NFTA_SET_NAME, set->name);
+        mnl_attr_put_u64(msg, NFTA_SET_HANDLE, htobe64(set->handle));
+        mnl_attr_put_u32(msg, NFTA_SET_FLAGS, htonl(set->flags));
+        mnl_attr_put_u32(msg, NFTA_SET_KEY_LEN, htonl(set->key_len));
+        if (set->data_len)
+            mnl_attr_put_u32(msg, NFTA_SET_DATA_LEN, htonl(set->data_len));
+        if (set->timeout)
+            mnl_attr_put_u64(msg, NFTA_SET_TIMEOUT, htobe64(set->timeout));
+        _nf_nftnl_emu_commit(out, msg);
+
+        if (!(req->nlmsg_flags & NLM_F_DUMP))
+            return 0;
+    }
+
+    if (!(req->nlmsg_flags & NLM_F_DUMP))
+        return -ENOENT;
+    return _nf_nftnl_emu_done(out, req);
+}
+
+static int _NetfilterEmulatorHandle_getgen (NetfilterEmulatorHandle* self, const struct nlmsghdr* req,
+                                            _nf_nftnl_emu_out* out) {
+    struct nlmsghdr* msg;
+    msg = _nf_nftnl_emu_reply(out, req, NFT_MSG_NEWGEN, 0, NFPROTO_UNSPEC, self->gen);
+    if (!msg)
+        return -ENOMEM;
+    mnl_attr_put_u32(msg, NFTA_GEN_ID, htonl(self->gen));
+    mnl_attr_put_u32(msg, NFTA_GEN_PROC_PID, htonl(getpid()));
+    _nf_nftnl_emu_commit(out, msg);
+    return 0;
+}
+
+/* Handles one datagram the way nfnetlink does: messages between a batch
+   begin and end form one transaction, anything else is a request on its
+   own. Returns how many elements the datagram touched. */
+static size_t _NetfilterEmulatorHandle_process (NetfilterEmulatorHandle* self, const char* buf, int len,
+                                                _nf_nftnl_emu_out* out) {
+    const struct nlmsghdr* msg;
+    size_t touched = 0; int batch = 0; int failed = 0;
+    int ret;
+
+    for (msg = (const struct nlmsghdr*) buf; mnl_nlmsg_ok(msg, len); msg = mnl_nlmsg_next(msg, &len)) {
+        if (msg->nlmsg_len < NLMSG_HDRLEN + sizeof(struct nfgenmsg) && msg->nlmsg_type >= NLMSG_MIN_TYPE) {
+            _nf_nftnl_emu_ack(out, msg, -EINVAL);
+            continue;
+        }
+
+        if (msg->nlmsg_type == NFNL_MSG_BATCH_BEGIN) {
+            if (batch)
+                _NetfilterEmulatorHandle_finish(self, 0);
+            batch = 1;
+            failed = 0;
+            continue;
+        }
+
+        if (msg->nlmsg_type == NFNL_MSG_BATCH_END) {
+            if (batch) {
+                _NetfilterEmulatorHandle_finish(self, !failed);
+                if (!failed)
+                    self->commits++;
+            }
+            batch = 0;
+            continue;
+        }
+
+        if (NFNL_SUBSYS_ID(msg->nlmsg_type) != NFNL_SUBSYS_NFTABLES) {
+            _nf_nftnl_emu_ack(out, msg, -EINVAL);
+            continue;
+        }
+
+        switch (NFNL_MSG_TYPE(msg->nlmsg_type)) {
+            case NFT_MSG_NEWTABLE:
+                ret = batch ? _NetfilterEmulatorHandle_newtable(self, msg) : -EINVAL;
+                break;
+            case NFT_MSG_NEWSET:
+                ret = batch ? _NetfilterEmulatorHandle_newset(self, msg) : -EINVAL;
+                break;
+            case NFT_MSG_DELSET:
+                ret = batch ? _NetfilterEmulatorHandle_delset(self, msg) : -EINVAL;
+                break;
+            case NFT_MSG_NEWSETELEM:
+                ret = batch ? _NetfilterEmulatorHandle_setelem(self, msg, 1, &touched) : -EINVAL;
+                break;
+            case NFT_MSG_DELSETELEM:
+                ret = batch ? _NetfilterEmulatorHandle_setelem(self, msg, 0, &touched) : -EINVAL;
+                break;
+            case NFT_MSG_GETSETELEM:
+                ret = batch ? -EINVAL : _NetfilterEmulatorHandle_getsetelem(self, msg, out);
+                break;
+            case NFT_MSG_GETSET:
+                ret = batch ? -EINVAL : _NetfilterEmulatorHandle_getset(self, msg, out);
+                break;
+            case NFT_MSG_GETGEN:
+                ret = batch ? -EINVAL : _NetfilterEmulatorHandle_getgen(self, msg, out);
+                break;
+            default:
+                ret = -EOPNOTSUPP;
+        }
+
+        if (ret < 0)
+            failed = 1;
+        if (ret < 0 || (batch && (msg->nlmsg_flags & NLM_F_ACK)) ||
+            (!batch && (msg->nlmsg_flags & NLM_F_ACK) && !(msg->nlmsg_flags & NLM_F_DUMP)))
+            _nf_nftnl_emu_ack(out, msg, ret);
+    }
+
+    /* A batch that never ends is aborted */
+    if (batch)
+        _NetfilterEmulatorHandle_finish(self, 0);
+
+    return touched;
+}
+
+/* Sends the replies in datagrams of at most NF_NFTNL_EMU_DGRAM bytes,
+   never splitting a message */
+static int _nf_nftnl_emu_send (int fd, _nf_nftnl_emu_out* out) {
+    const struct nlmsghdr* msg;
+    size_t start = 0; size_t end = 0; size_t size;
+
+    while (end < out->len) {
+        msg = (const struct nlmsghdr*) (out->data + end);
+        size = MNL_ALIGN(msg->nlmsg_len);
+        if (end > start && end + size - start > NF_NFTNL_EMU_DGRAM) {
+            if (send(fd, out->data + start, end - start, MSG_NOSIGNAL) < 0)
+                return -1;
+            start = end;
+        }
+        end += size;
+    }
+
+    if (end > start && send(fd, out->data + start, end - start, MSG_NOSIGNAL) < 0)
+        return -1;
+    return 0;
+}
+
+/* Answers one datagram from a connection. Returns -1 once the connection
+   is closed or broken. */
+static int _NetfilterEmulatorHandle_serve_one (NetfilterEmulatorHandle* self, int fd, char** buffer,
+                                               size_t* bufsize, _nf_nftnl_emu_out* out) {
+    struct timespec ts; char* grown;
+    ssize_t ret; double delay; size_t touched;
+
+    /* Batches arrive as single datagrams of any size */
+    ret = recv(fd, NULL, 0, MSG_PEEK | MSG_TRUNC | MSG_DONTWAIT);
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return 0;
+    if (ret <= 0)
+        return -1;
+    if ((size_t) ret > *bufsize) {
+        grown = realloc(*buffer, ret);
+        if (!grown)
+            return -1;
+        *buffer = grown;
+        *bufsize = ret;
+    }
+    ret = recv(fd, *buffer, *bufsize, 0);
+    if (ret <= 0)
+        return -1;
+
+    out->len = 0;
+    pthread_mutex_lock(&self->lock);
+    touched = _NetfilterEmulatorHandle_process(self, *buffer, (int) ret, out);
+    delay = self->latency + self->per_element * touched;
+    pthread_mutex_unlock(&self->lock);
+
+    if (delay > 0) {
+        ts.tv_sec = (time_t) delay;
+        ts.tv_nsec = (long) ((delay - ts.tv_sec) * 1e9);
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+    }
+
+    return _nf_nftnl_emu_send(fd, out);
+}
+
+static void _NetfilterEmulatorHandle_drop (NetfilterEmulatorHandle* self, int fd) {
+    size_t i;
+    pthread_mutex_lock(&self->lock);
+    for (i = 0; i < self->peers_len; i++)
+        if (self->peers[i] == fd) {
+            self->peers[i] = self->peers[--self->peers_len];
+            close(fd);
+            break;
+        }
+    pthread_mutex_unlock(&self->lock);
+}
+
+static void* _NetfilterEmulatorHandle_serve (void* arg) {
+    NetfilterEmulatorHandle* self = (NetfilterEmulatorHandle*) arg;
+    _nf_nftnl_emu_out out = {NULL, 0, 0};
+    struct pollfd* fds = NULL; struct pollfd* grown;
+    char* buffer = NULL; size_t bufsize = 0;
+    char drain[64]; size_t nfds; size_t i;
+
+    for (;;) {
+        /* Connections come and go, so the set of descriptors is taken anew
+           every time the thread is woken up */
+        pthread_mutex_lock(&self->lock);
+        if (self->stopping) {
+            pthread_mutex_unlock(&self->lock);
+            break;
+        }
+        nfds = self->peers_len + 1;
+        grown = realloc(fds, nfds * sizeof(struct pollfd));
+        if (!grown) {
+            pthread_mutex_unlock(&self->lock);
+            break;
+        }
+        fds = grown;
+        fds[0].fd = self->wake[0];
+        fds[0].events = POLLIN;
+        for (i = 1; i < nfds; i++) {
+            fds[i].fd = self->peers[i - 1];
+            fds[i].events = POLLIN;
+        }
+        pthread_mutex_unlock(&self->lock);
+
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (fds[0].revents) {
+            while (read(self->wake[0], drain, sizeof(drain)) > 0);
+            continue;
+        }
+
+        for (i = 1; i < nfds; i++)
+            if (fds[i].revents &&
+                _NetfilterEmulatorHandle_serve_one(self, fds[i].fd, &buffer, &bufsize, &out) < 0)
+                _NetfilterEmulatorHandle_drop(self, fds[i].fd);
+    }
+
+    free(fds);
+    free(buffer);
+    free(out.data);
+    return NULL;
+}
+
+/* Opens a new connection and returns the caller's end of it */
+static int _NetfilterEmulatorHandle_connect (NetfilterEmulatorHandle* self) {
+    int fds[2]; int* peers; size_t cap;
+
+    /* SOCK_SEQPACKET keeps message boundaries, like netlink does */
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0)
+        return -1;
+
+    /* Big batches are sent as one datagram, so allow for large ones */
+    _nf_nftnl_sndbuf(fds[0], 1 << 24);
+    _nf_nftnl_sndbuf(fds[1], 1 << 24);
+
+    pthread_mutex_lock(&self->lock);
+    if (self->peers_len == self->peers_cap) {
+        cap = self->peers_cap ? self->peers_cap * 2 : 4;
+        peers = realloc(self->peers, cap * sizeof(int));
+        if (!peers) {
+            pthread_mutex_unlock(&self->lock);
+            close(fds[0]);
+            close(fds[1]);
+            errno = ENOMEM;
+            return -1;
+        }
+        self->peers = peers;
+        self->peers_cap = cap;
+    }
+    self->peers[self->peers_len++] = fds[1];
+    pthread_mutex_unlock(&self->lock);
+
+    if (write(self->wake[1], "", 1) < 0) {}
+    return fds[0];
+}
+
+static PyObject* NetfilterEmulatorHandle_new (PyTypeObject* type, PyTupleObject* args) {
+    NetfilterEmulatorHandle* self;
+    self = (NetfilterEmulatorHandle*) type->tp_alloc(type, 0);
+    self->fd = -1;
+    self->wake[0] = -1;
+    self->wake[1] = -1;
+    self->peers = NULL;
+    self->peers_len = 0;
+    self->peers_cap = 0;
+    self->running = 0;
+    self->stopping = 0;
+    pthread_mutex_init(&self->lock, NULL);
+    self->latency = 0;
+    self->per_element = 0;
+    self->gen = 1;
+    self->handle = 0;
+    self->commits = 0;
+    self->tables = NULL;
+    self->sets = NULL;
+    self->undo = NULL;
+    return (PyObject*) self;
+}
+
+static int NetfilterEmulatorHandle_init (NetfilterEmulatorHandle* self, PyTupleObject* args) {
+    return 0;
+}
 
-    return PyInt_FromLong(self->seq);
+static void NetfilterEmulatorHandle_dealloc (NetfilterEmulatorHandle* self) {
+    _nf_nftnl_emu_table* table; _nf_nftnl_emu_set* set;
+    size_t i;
+
+    if (self->running) {
+        /* A reply blocked on a connection nobody reads would keep the thread
+           from ever seeing the stop request, so every connection is shut */
+        pthread_mutex_lock(&self->lock);
+        self->stopping = 1;
+        for (i = 0; i < self->peers_len; i++)
+            shutdown(self->peers[i], SHUT_RDWR);
+        pthread_mutex_unlock(&self->lock);
+        if (write(self->wake[1], "", 1) < 0) {}
+        Py_BEGIN_ALLOW_THREADS
+        pthread_join(self->thread, NULL);
+        Py_END_ALLOW_THREADS
+    }
+    if (self->fd >= 0) close(self->fd);
+    for (i = 0; i < self->peers_len; i++)
+        close(self->peers[i]);
+    free(self->peers);
+    if (self->wake[0] >= 0) close(self->wake[0]);
+    if (self->wake[1] >= 0) close(self->wake[1]);
+
+    while ((table = self->tables)) {
+        self->tables = table->next;
+        free(table);
+    }
+    while ((set = self->sets)) {
+        self->sets = set->next;
+        _nf_nftnl_emu_set_free(set);
+    }
+    pthread_mutex_destroy(&self->lock);
+    Py_TYPE(self)->tp_free((PyObject*) self);
 }
 
-static PyObject* NetfilterBatchHandle_elem_del (NetfilterBatchHandle* self, PyTupleObject* args) {
-    struct nlmsghdr* msg;
+static PyObject* NetfilterEmulatorHandle_fileno (NetfilterEmulatorHandle* self) {
+    return PyInt_FromLong((long) self->fd);
+}
 
-    NetfilterSetHandle* set;
-    uint16_t family; PyObject* ack;
-    uint16_t flags = 0;
+/* A NetfilterSocketHandle talking to the emulator instead of the kernel,
+   over a connection of its own. The handle keeps the emulator alive. The
+   descriptor is left blocking: the handle never waits on it anyway. */
+static PyObject* NetfilterEmulatorHandle_socket (NetfilterEmulatorHandle* self) {
+    PyObject* empty;
+    NetfilterSocketHandle* handle_object;
+    char* buffer; int fd;
 
-    if (!PyArg_ParseTuple((PyObject*) args, "OHO", &set, &family, &ack)) {
-        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, uint16_t family, bool ack)");
+    fd = _NetfilterEmulatorHandle_connect(self);
+    if (fd < 0)
+        return PyErr_SetFromErrno(PyExc_OSError);
+
+    buffer = malloc(MNL_SOCKET_DUMP_SIZE);
+    if (!buffer) {
+        PyErr_SetString(PyExc_OSError, "Call to malloc failed");
+        close(fd);
         return NULL;
     }
 
-    if (!PyObject_IsInstance((PyObject*) set, (PyObject*) &NetfilterSetHandleType)) {
-        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, uint16_t family, bool ack)");
+    empty = PyTuple_New(0);
+    handle_object = (NetfilterSocketHandle*) PyObject_CallObject((PyObject*) &NetfilterSocketHandleType, empty);
+    Py_DECREF(empty);
+
+    if (!handle_object) {
+        free(buffer);
+        close(fd);
         return NULL;
     }
 
-    if (!PyBool_Check(ack)) {
-        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, uint16_t family, bool ack)");
+    handle_object->fd = fd;
+    handle_object->buffer = buffer;
+    handle_object->bufsize = MNL_SOCKET_DUMP_SIZE;
+    Py_INCREF(self);
+    handle_object->owner = (PyObject*) self;
+
+    return (PyObject*) handle_object;
+}
+
+/* Creates a table outside of any transaction, as if it had been set up
+   beforehand, since batches only carry sets and elements */
+static PyObject* NetfilterEmulatorHandle_table (NetfilterEmulatorHandle* self, PyTupleObject* args) {
+    char* name; uint16_t family;
+    _nf_nftnl_emu_table* table;
+
+    if (!PyArg_ParseTuple((PyObject*) args, "sH", &name, &family) || strlen(name) >= NFT_TABLE_MAXNAMELEN) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (char* name, uint16_t family)");
         return NULL;
     }
 
-    flags |= ((PyObject_IsTrue(ack)) ? (NLM_F_ACK) : (0));
-
-    msg = nftnl_nlmsg_build_hdr(mnl_nlmsg_batch_current(self->handle),
-                                NFT_MSG_DELSETELEM, family, flags,
-                                self->seq++);
-    nftnl_set_elems_nlmsg_build_payload(msg, set->handle);
-    mnl_nlmsg_batch_next(self->handle);
+    pthread_mutex_lock(&self->lock);
+    if (!_NetfilterEmulatorHandle_table(self, family, name)) {
+        table = calloc(1, sizeof(_nf_nftnl_emu_table));
+        if (!table) {
+            pthread_mutex_unlock(&self->lock);
+            PyErr_SetString(PyExc_OSError, "Call to calloc failed");
+            return NULL;
+        }
+        table->family = family;
+        strcpy(table->name, name);
+        table->next = self->tables;
+        self->tables = table;
+        self->gen++;
+    }
+    pthread_mutex_unlock(&self->lock);
 
-    return PyInt_FromLong(self->seq);
+    Py_RETURN_NONE;
 }
 
-static PyObject* NetfilterBatchHandle_end (NetfilterBatchHandle* self) {
-    if (!self->handle || !self->buffer) {
-        PyErr_SetString(PyExc_OSError, "NetfilterBatchHandle.begin must be called prior");
+static PyObject* NetfilterEmulatorHandle_count (NetfilterEmulatorHandle* self, PyTupleObject* args) {
+    char* table; char* name; uint16_t family;
+    _nf_nftnl_emu_set* set; _nf_nftnl_emu_elem* elem;
+    double now = _nf_nftnl_now();
+    size_t count = 0; uint32_t i;
+
+    if (!PyArg_ParseTuple((PyObject*) args, "ssH", &table, &name, &family)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (char* table, char* name, uint16_t family)");
         return NULL;
     }
 
-    nftnl_batch_end(mnl_nlmsg_batch_current(self->handle), self->seq++);
-    mnl_nlmsg_batch_next(self->handle);
-    return PyInt_FromLong(self->seq);
+    pthread_mutex_lock(&self->lock);
+    set = _NetfilterEmulatorHandle_set(self, family, table, name, NULL);
+    for (i = 0; set && set->buckets && i <= set->mask; i++)
+        for (elem = set->buckets[i]; elem; elem = elem->next)
+            count += !_nf_nftnl_emu_expired(elem, now);
+    pthread_mutex_unlock(&self->lock);
+
+    if (!set) {
+        PyErr_SetString(PyExc_LookupError, "Set does not exist");
+        return NULL;
+    }
+    return PyLong_FromSize_t(count);
 }
 
-static PyObject* NetfilterBatchHandle_dump (NetfilterBatchHandle* self) {
-    return PyString_FromStringAndSize(mnl_nlmsg_batch_head(self->handle),
-                                      (Py_ssize_t) mnl_nlmsg_batch_size(self->handle));
+static PyObject* NetfilterEmulatorHandle_generation (NetfilterEmulatorHandle* self) {
+    uint32_t gen;
+    pthread_mutex_lock(&self->lock);
+    gen = self->gen;
+    pthread_mutex_unlock(&self->lock);
+    return PyLong_FromUnsignedLong(gen);
 }
 
-static PyMemberDef NetfilterBatchHandle_members[] = {
+static PyObject* NetfilterEmulatorHandle_commits (NetfilterEmulatorHandle* self) {
+    uint64_t commits;
+    pthread_mutex_lock(&self->lock);
+    commits = self->commits;
+    pthread_mutex_unlock(&self->lock);
+    return PyLong_FromUnsignedLongLong(commits);
+}
+
+static PyObject* NetfilterEmulatorHandle_get_latency (NetfilterEmulatorHandle* self, void* closure) {
+    return PyFloat_FromDouble(closure ? self->per_element : self->latency);
+}
+
+static int NetfilterEmulatorHandle_set_latency (NetfilterEmulatorHandle* self, PyObject* value, void* closure) {
+    double latency = value ? PyFloat_AsDouble(value) : -1;
+
+    if (latency < 0 || PyErr_Occurred()) {
+        PyErr_Clear();
+        PyErr_SetString(PyExc_ValueError, "Latency must be a non-negative number of seconds");
+        return -1;
+    }
+
+    pthread_mutex_lock(&self->lock);
+    if (closure) self->per_element = latency;
+    else self->latency = latency;
+    pthread_mutex_unlock(&self->lock);
+    return 0;
+}
+
+static PyMemberDef NetfilterEmulatorHandle_members[] = {
     {NULL}
 };
 
-static PyMethodDef NetfilterBatchHandle_methods[] = {
-    {"begin", (PyCFunction) NetfilterBatchHandle_begin, METH_VARARGS, NULL},
-    {"set_put", (PyCFunction) NetfilterBatchHandle_set_put, METH_VARARGS, NULL},
-    {"set_del", (PyCFunction) NetfilterBatchHandle_set_del, METH_VARARGS, NULL},
-    {"elem_put", (PyCFunction) NetfilterBatchHandle_elem_put, METH_VARARGS, NULL},
-    {"elem_del", (PyCFunction) NetfilterBatchHandle_elem_del, METH_VARARGS, NULL},
-    {"end", (PyCFunction) NetfilterBatchHandle_end, METH_NOARGS, NULL},
-    {"dump", (PyCFunction) NetfilterBatchHandle_dump, METH_NOARGS, NULL},
+static PyGetSetDef NetfilterEmulatorHandle_getset[] = {
+    {"latency", (getter) NetfilterEmulatorHandle_get_latency, (setter) NetfilterEmulatorHandle_set_latency, NULL, NULL},
+    {"per_element", (getter) NetfilterEmulatorHandle_get_latency, (setter) NetfilterEmulatorHandle_set_latency, NULL, (void*) 1},
     {NULL}
 };
 
-static PyTypeObject NetfilterBatchHandleType = {
+static PyMethodDef NetfilterEmulatorHandle_methods[] = {
+    {"fileno", (PyCFunction) NetfilterEmulatorHandle_fileno, METH_NOARGS, NULL},
+    {"socket", (PyCFunction) NetfilterEmulatorHandle_socket, METH_NOARGS, NULL},
+    {"table", (PyCFunction) NetfilterEmulatorHandle_table, METH_VARARGS, NULL},
+    {"count", (PyCFunction) NetfilterEmulatorHandle_count, METH_VARARGS, NULL},
+    {"generation", (PyCFunction) NetfilterEmulatorHandle_generation, METH_NOARGS, NULL},
+    {"commits", (PyCFunction) NetfilterEmulatorHandle_commits, METH_NOARGS, NULL},
+    {NULL}
+};
+
+static PyTypeObject NetfilterEmulatorHandleType = {
     PyVarObject_HEAD_INIT(NULL, 0)
-    "libnftnlset.NetfilterBatchHandle",            /* tp_name */
-    sizeof(NetfilterBatchHandle),                  /* tp_basicsize */
+    "libnftnlset.NetfilterEmulatorHandle",         /* tp_name */
+    sizeof(NetfilterEmulatorHandle),               /* tp_basicsize */
     0,                                             /* tp_itemsize */
-    (destructor) NetfilterBatchHandle_dealloc,     /* tp_dealloc */
+    (destructor) NetfilterEmulatorHandle_dealloc,  /* tp_dealloc */
     0,                                             /* tp_print */
     0,                                             /* tp_getattr */
     0,                                             /* tp_setattr */
@@ -747,27 +5279,27 @@ static PyTypeObject NetfilterBatchHandleType = {
     0,                                             /* tp_setattro */
     0,                                             /* tp_as_buffer */
     Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,      /* tp_flags */
-    "Wrapper for (struct mnl_nlmsg_batch *)",      /* tp_doc */
+    "In-process nf_tables netlink emulator",       /* tp_doc */
     0,                                             /* tp_traverse */
     0,                                             /* tp_clear */
     0,                                             /* tp_richcompare */
     0,                                             /* tp_weaklistoffset */
     0,                                             /* tp_iter */
     0,                                             /* tp_iternext */
-    NetfilterBatchHandle_methods,                  /* tp_methods */
-    NetfilterBatchHandle_members,                  /* tp_members */
-    0,                                             /* tp_getset */
+    NetfilterEmulatorHandle_methods,               /* tp_methods */
+    NetfilterEmulatorHandle_members,               /* tp_members */
+    NetfilterEmulatorHandle_getset,                /* tp_getset */
     0,                                             /* tp_base */
     0,                                             /* tp_dict */
     0,                                             /* tp_descr_get */
     0,                                             /* tp_descr_set */
     0,                                             /* tp_dictoffset */
-    (initproc) NetfilterBatchHandle_init,          /* tp_init */
+    (initproc) NetfilterEmulatorHandle_init,       /* tp_init */
     0,                                             /* tp_alloc */
-    (newfunc) NetfilterBatchHandle_new,            /* tp_new */
+    (newfunc) NetfilterEmulatorHandle_new,         /* tp_new */
 };
 
-// END: NetfilterBatchHandle
+// END: NetfilterEmulatorHandle
 
 static PyObject* libnftnlset_element (PyObject* self) {
     PyObject* empty;
@@ -820,6 +5352,400 @@ static PyObject* libnftnlset_batch (PyObject* self) {
     return (PyObject*) handle_object;
 }
 
+static PyObject* libnftnlset_socket (PyObject* self) {
+    PyObject* empty;
+    NetfilterSocketHandle* handle_object;
+    struct sockaddr_nl addr;
+    char* buffer; int fd; int on = 1;
+
+    fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_NETFILTER);
+    if (fd < 0)
+        return PyErr_SetFromErrno(PyExc_OSError);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        close(fd);
+        return NULL;
+    }
+
+    /* Errors only need to echo the header of the offending message */
+    setsockopt(fd, SOL_NETLINK, NETLINK_CAP_ACK, &on, sizeof(on));
+
+    buffer = malloc(MNL_SOCKET_DUMP_SIZE);
+    if (!buffer) {
+        PyErr_SetString(PyExc_OSError, "Call to malloc failed");
+        close(fd);
+        return NULL;
+    }
+
+    empty = PyTuple_New(0);
+    handle_object = (NetfilterSocketHandle*) PyObject_CallObject((PyObject*) &NetfilterSocketHandleType, empty);
+    Py_DECREF(empty);
+
+    if (!handle_object) {
+        free(buffer);
+        close(fd);
+        return NULL;
+    }
+
+    handle_object->fd = fd;
+    handle_object->buffer = buffer;
+    handle_object->bufsize = MNL_SOCKET_DUMP_SIZE;
+
+    return (PyObject*) handle_object;
+}
+
+static PyObject* libnftnlset_cache (PyObject* self) {
+    PyObject* empty;
+    NetfilterCacheHandle* handle_object;
+
+    empty = PyTuple_New(0);
+    handle_object = (NetfilterCacheHandle*) PyObject_CallObject((PyObject*) &NetfilterCacheHandleType, empty);
+    Py_DECREF(empty);
+
+    return (PyObject*) handle_object;
+}
+
+static PyObject* libnftnlset_lookup_many (PyObject* self, PyObject* args) {
+    PyObject* empty; PyObject* set_object; PyObject* keys;
+    NetfilterSetHandle* set; NetfilterLookupHandle* handle_object;
+    uint16_t family; uint32_t key_len; uint32_t count; uint32_t i;
+    uint32_t window = NF_NFTNL_LOOKUP_WINDOW;
+    size_t msglen = 0; char* buffer; char* scratch;
+
+    if (!PyArg_ParseTuple(args, "OSH|I", &set_object, &keys, &family, &window)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, bytes keys, uint16_t family, uint32_t window)");
+        return NULL;
+    }
+
+    if (!PyObject_IsInstance(set_object, (PyObject*) &NetfilterSetHandleType) || !window) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, bytes keys, uint16_t family, uint32_t window)");
+        return NULL;
+    }
+
+    set = (NetfilterSetHandle*) set_object;
+    key_len = nftnl_set_get_u32(set->handle, NFTNL_SET_KEY_LEN);
+    if (!key_len || PyString_GET_SIZE(keys) % key_len) {
+        PyErr_SetString(PyExc_ValueError, "Key buffer must be a multiple of the set key_len");
+        return NULL;
+    }
+    count = PyString_GET_SIZE(keys) / key_len;
+
+    empty = PyTuple_New(0);
+    handle_object = (NetfilterLookupHandle*) PyObject_CallObject((PyObject*) &NetfilterLookupHandleType, empty);
+    Py_DECREF(empty);
+    if (!handle_object)
+        return NULL;
+
+    handle_object->seq = time(NULL);
+    handle_object->count = count;
+    handle_object->remaining = count;
+    handle_object->data_len = nftnl_set_get_u32(set->handle, NFTNL_SET_DATA_LEN);
+    handle_object->found = calloc((count + 7) / 8 + 1, 1);
+    handle_object->answered = calloc((count + 7) / 8 + 1, 1);
+    handle_object->sent = calloc((count + 7) / 8 + 1, 1);
+    handle_object->data = calloc((size_t) count * handle_object->data_len + 1, 1);
+    handle_object->expiration = calloc((size_t) count + 1, sizeof(uint64_t));
+
+    /* Every request carries the same set attributes and a single key of the
+       same length, so they all share the size of the first one */
+    scratch = count ? malloc(NF_NFTNL_MSG_CHUNK + NF_NFTNL_BATCH_OVERRUN) : NULL;
+    if (scratch)
+        msglen = _nf_nftnl_set_lookup_build(scratch, set->handle, family, 0,
+                                            PyString_AS_STRING(keys), key_len);
+    if (scratch || !count)
+        handle_object->request = PyString_FromStringAndSize(NULL, (Py_ssize_t) (count * msglen));
+    free(scratch);
+
+    /* A window never takes more than one message chunk to send */
+    if (msglen && window > NF_NFTNL_MSG_CHUNK / msglen)
+        window = NF_NFTNL_MSG_CHUNK / msglen ? NF_NFTNL_MSG_CHUNK / msglen : 1;
+    handle_object->window = window;
+    handle_object->msglen = msglen;
+
+    if (!handle_object->found || !handle_object->answered || !handle_object->sent || !handle_object->data ||
+        !handle_object->expiration || !handle_object->request) {
+        Py_DECREF(handle_object);
+        PyErr_SetString(PyExc_OSError, "Call to malloc failed");
+        return NULL;
+    }
+
+    buffer = PyString_AS_STRING(handle_object->request);
+    for (i = 0; i < count; i++)
+        buffer += _nf_nftnl_set_lookup_build(buffer, set->handle, family, handle_object->seq + i,
+                                             PyString_AS_STRING(keys) + (size_t) i * key_len, key_len);
+
+    return (PyObject*) handle_object;
+}
+
+static PyObject* libnftnlset_elem_dump (PyObject* self, PyObject* args) {
+    PyObject* empty; PyObject* set_object;
+    NetfilterSetHandle* set; NetfilterDumpHandle* handle_object;
+    struct nlmsghdr* msg; char* buffer; uint16_t family;
+
+    if (!PyArg_ParseTuple(args, "OH", &set_object, &family)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, uint16_t family)");
+        return NULL;
+    }
+
+    if (!PyObject_IsInstance(set_object, (PyObject*) &NetfilterSetHandleType)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (NetfilterSetHandle set, uint16_t family)");
+        return NULL;
+    }
+
+    set = (NetfilterSetHandle*) set_object;
+
+    buffer = malloc(NF_NFTNL_MSG_CHUNK);
+    if (!buffer) {
+        PyErr_SetString(PyExc_OSError, "Call to malloc failed");
+        return NULL;
+    }
+
+    empty = PyTuple_New(0);
+    handle_object = (NetfilterDumpHandle*) PyObject_CallObject((PyObject*) &NetfilterDumpHandleType, empty);
+    Py_DECREF(empty);
+    if (!handle_object) {
+        free(buffer);
+        return NULL;
+    }
+
+    handle_object->seq = time(NULL);
+    handle_object->key_len = nftnl_set_get_u32(set->handle, NFTNL_SET_KEY_LEN);
+
+    msg = nftnl_nlmsg_build_hdr(buffer, NFT_MSG_GETSETELEM, family, NLM_F_DUMP, handle_object->seq);
+    _nf_nftnl_set_elem_build_def(msg, set->handle);
+    handle_object->request = PyString_FromStringAndSize(buffer, (Py_ssize_t) msg->nlmsg_len);
+    free(buffer);
+
+    if (!handle_object->request) {
+        Py_DECREF(handle_object);
+        return NULL;
+    }
+
+    return (PyObject*) handle_object;
+}
+
+static PyObject* libnftnlset_store (PyObject* self, PyObject* args) {
+    PyObject* empty; PyObject* key; PyObject* field;
+    NetfilterStoreHandle* handle_object;
+    uint32_t data_len; uint32_t key_len = 0; uint32_t input_len = 0;
+    uint8_t fields[NFT_REG32_COUNT]; uint32_t field_count = 0;
+    long value; Py_ssize_t i;
+
+    if (!PyArg_ParseTuple(args, "OI", &key, &data_len)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (uint32_t key_len | tuple fields, uint32_t data_len)");
+        return NULL;
+    }
+
+    if (PyTuple_Check(key)) {
+        if (PyTuple_GET_SIZE(key) < 1 || PyTuple_GET_SIZE(key) > NFT_REG32_COUNT) {
+            PyErr_SetString(PyExc_ValueError, "A concatenated key must have between 1 and 16 fields");
+            return NULL;
+        }
+        for (i = 0; i < PyTuple_GET_SIZE(key); i++) {
+            field = PyTuple_GET_ITEM(key, i);
+            value = PyInt_Check(field) ? PyInt_AsLong(field) : 0;
+            if (value < 1 || value > NFT_DATA_VALUE_MAXLEN) {
+                PyErr_SetString(PyExc_ValueError, "Key fields must be between 1 and 64 bytes long");
+                return NULL;
+            }
+            fields[field_count++] = (uint8_t) value;
+            input_len += value;
+            key_len += MNL_ALIGN(value);
+        }
+    } else if (PyInt_Check(key)) {
+        value = PyInt_AsLong(key);
+        key_len = input_len = value > 0 ? (uint32_t) value : 0;
+    } else {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (uint32_t key_len | tuple fields, uint32_t data_len)");
+        return NULL;
+    }
+
+    if (!key_len || key_len > NFT_DATA_VALUE_MAXLEN || data_len > NFT_DATA_VALUE_MAXLEN) {
+        PyErr_SetString(PyExc_ValueError, "Keys and data must be between 1 and 64 bytes long");
+        return NULL;
+    }
+
+    empty = PyTuple_New(0);
+    handle_object = (NetfilterStoreHandle*) PyObject_CallObject((PyObject*) &NetfilterStoreHandleType, empty);
+    Py_DECREF(empty);
+    if (!handle_object)
+        return NULL;
+
+    handle_object->key_len = key_len;
+    handle_object->data_len = data_len;
+    handle_object->key_stride = MNL_ALIGN(key_len);
+    handle_object->data_stride = MNL_ALIGN(data_len);
+    handle_object->stride = (sizeof(uint64_t) + handle_object->key_stride +
+                             handle_object->data_stride + 7) & ~7;
+    handle_object->input_len = input_len;
+    handle_object->field_count = field_count;
+    memcpy(handle_object->fields, fields, field_count);
+
+    return (PyObject*) handle_object;
+}
+
+static PyObject* libnftnlset_pacer (PyObject* self, PyObject* args) {
+    PyObject* empty;
+    NetfilterPacerHandle* handle_object;
+    double target; double rate; double burst = 1;
+    uint32_t min_size = 64; uint32_t max_size = 1 << 20;
+
+    if (!PyArg_ParseTuple(args, "dd|dII", &target, &rate, &burst, &min_size, &max_size)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (double target, double rate, double burst=1, uint32_t min_size=64, uint32_t max_size=1048576)");
+        return NULL;
+    }
+
+    if (target <= 0 || rate < 0 || burst < 1 || !min_size || min_size > max_size) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (double target, double rate, double burst=1, uint32_t min_size=64, uint32_t max_size=1048576)");
+        return NULL;
+    }
+
+    empty = PyTuple_New(0);
+    handle_object = (NetfilterPacerHandle*) PyObject_CallObject((PyObject*) &NetfilterPacerHandleType, empty);
+    Py_DECREF(empty);
+    if (!handle_object)
+        return NULL;
+
+    handle_object->target = target;
+    handle_object->rate = rate;
+    handle_object->burst = burst;
+    handle_object->tokens = burst;
+    handle_object->size = min_size;
+    handle_object->min_size = min_size;
+    handle_object->max_size = max_size;
+
+    return (PyObject*) handle_object;
+}
+
+static PyObject* libnftnlset_fanout (PyObject* self, PyObject* args) {
+    PyObject* empty; PyObject* namespaces; PyObject* seq; PyObject* item;
+    NetfilterFanoutHandle* handle_object;
+    _nf_nftnl_fanout job;
+    uint32_t workers = 16; double timeout = 5;
+    int* nsfds; Py_ssize_t count; Py_ssize_t i;
+
+    if (!PyArg_ParseTuple(args, "O|Id", &namespaces, &workers, &timeout)) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (list namespaces, uint32_t workers=16, double timeout=5)");
+        return NULL;
+    }
+
+    if (!workers || timeout <= 0) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (list namespaces, uint32_t workers=16, double timeout=5)");
+        return NULL;
+    }
+
+    seq = PySequence_Fast(namespaces, "Parameters must be (list namespaces, uint32_t workers=16, double timeout=5)");
+    if (!seq)
+        return NULL;
+    count = PySequence_Fast_GET_SIZE(seq);
+
+    empty = PyTuple_New(0);
+    handle_object = (NetfilterFanoutHandle*) PyObject_CallObject((PyObject*) &NetfilterFanoutHandleType, empty);
+    Py_DECREF(empty);
+    if (!handle_object) {
+        Py_DECREF(seq);
+        return NULL;
+    }
+
+    nsfds = malloc(sizeof(int) * (count ? count : 1));
+    handle_object->netns = malloc(sizeof(_nf_nftnl_netns) * (count ? count : 1));
+    if (!nsfds || !handle_object->netns) {
+        free(nsfds);
+        Py_DECREF(seq);
+        Py_DECREF(handle_object);
+        PyErr_SetString(PyExc_OSError, "Call to malloc failed");
+        return NULL;
+    }
+
+    /* Namespace file descriptors are duplicated, paths are opened. Either
+       way they are only needed until the sockets exist. */
+    for (i = 0; i < count; i++) {
+        item = PySequence_Fast_GET_ITEM(seq, i);
+        if (PyInt_Check(item)) {
+            nsfds[i] = fcntl((int) PyInt_AsLong(item), F_DUPFD_CLOEXEC, 0);
+        } else if (PyString_Check(item)) {
+            nsfds[i] = open(PyString_AS_STRING(item), O_RDONLY | O_CLOEXEC);
+        } else {
+            while (i--)
+                if (nsfds[i] >= 0) close(nsfds[i]);
+            free(nsfds);
+            Py_DECREF(seq);
+            Py_DECREF(handle_object);
+            PyErr_SetString(PyExc_ValueError, "Namespaces must be file descriptors or paths");
+            return NULL;
+        }
+        handle_object->netns[i].fd = -1;
+        handle_object->netns[i].error = nsfds[i] < 0 ? -errno : -EAGAIN;
+        handle_object->netns[i].result = 0;
+    }
+    handle_object->count = count;
+    handle_object->workers = workers;
+    Py_DECREF(seq);
+
+    memset(&job, 0, sizeof(job));
+    job.netns = handle_object->netns;
+    job.count = count;
+    job.run = _nf_nftnl_fanout_open;
+    job.nsfds = nsfds;
+    job.timeout.tv_sec = (time_t) timeout;
+    job.timeout.tv_usec = (suseconds_t) ((timeout - (time_t) timeout) * 1e6);
+
+    /* setns only ever runs on the worker threads, which exit right after */
+    Py_BEGIN_ALLOW_THREADS
+    _nf_nftnl_fanout_run(&job, workers);
+    Py_END_ALLOW_THREADS
+
+    for (i = 0; i < count; i++)
+        if (nsfds[i] >= 0) close(nsfds[i]);
+    free(nsfds);
+
+    return (PyObject*) handle_object;
+}
+
+static PyObject* libnftnlset_emulator (PyObject* self, PyObject* args) {
+    PyObject* empty;
+    NetfilterEmulatorHandle* handle_object;
+    double latency = 0; double per_element = 0;
+
+    if (!PyArg_ParseTuple(args, "|dd", &latency, &per_element) || latency < 0 || per_element < 0) {
+        PyErr_SetString(PyExc_ValueError, "Parameters must be (double latency=0, double per_element=0)");
+        return NULL;
+    }
+
+    empty = PyTuple_New(0);
+    handle_object = (NetfilterEmulatorHandle*) PyObject_CallObject((PyObject*) &NetfilterEmulatorHandleType, empty);
+    Py_DECREF(empty);
+    if (!handle_object)
+        return NULL;
+
+    handle_object->latency = latency;
+    handle_object->per_element = per_element;
+
+    if (pipe2(handle_object->wake, O_CLOEXEC | O_NONBLOCK) < 0) {
+        Py_DECREF(handle_object);
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+
+    /* The connection behind fileno() */
+    handle_object->fd = _NetfilterEmulatorHandle_connect(handle_object);
+    if (handle_object->fd < 0) {
+        Py_DECREF(handle_object);
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+
+    if (pthread_create(&handle_object->thread, NULL, _NetfilterEmulatorHandle_serve, handle_object)) {
+        Py_DECREF(handle_object);
+        PyErr_SetString(PyExc_OSError, "Call to pthread_create failed");
+        return NULL;
+    }
+    handle_object->running = 1;
+
+    return (PyObject*) handle_object;
+}
+
 static PyObject* libnftnlset_handle (PyObject* self, PyObject* args) {
     char* buf; uint32_t len;
     uint32_t seq; uint32_t pid;
@@ -838,6 +5764,14 @@ static PyMethodDef libnftnlset_methods[] = {
     {"element", (PyCFunction) libnftnlset_element, METH_NOARGS, NULL},
     {"set", (PyCFunction) libnftnlset_set, METH_NOARGS, NULL},
     {"batch", (PyCFunction) libnftnlset_batch, METH_NOARGS, NULL},
+    {"socket", (PyCFunction) libnftnlset_socket, METH_NOARGS, NULL},
+    {"cache", (PyCFunction) libnftnlset_cache, METH_NOARGS, NULL},
+    {"lookup_many", (PyCFunction) libnftnlset_lookup_many, METH_VARARGS, NULL},
+    {"elem_dump", (PyCFunction) libnftnlset_elem_dump, METH_VARARGS, NULL},
+    {"store", (PyCFunction) libnftnlset_store, METH_VARARGS, NULL},
+    {"pacer", (PyCFunction) libnftnlset_pacer, METH_VARARGS, NULL},
+    {"fanout", (PyCFunction) libnftnlset_fanout, METH_VARARGS, NULL},
+    {"emulator", (PyCFunction) libnftnlset_emulator, METH_VARARGS, NULL},
     {"handle", (PyCFunction) libnftnlset_handle, METH_VARARGS, NULL},
     {NULL}
 };
@@ -850,8 +5784,24 @@ PyMODINIT_FUNC initlibnftnlset (void) {
         return;
     if (PyType_Ready(&NetfilterSetHandleType) < 0)
         return;
+    if (PyType_Ready(&NetfilterStoreHandleType) < 0)
+        return;
     if (PyType_Ready(&NetfilterBatchHandleType) < 0)
         return;
+    if (PyType_Ready(&NetfilterSocketHandleType) < 0)
+        return;
+    if (PyType_Ready(&NetfilterCacheHandleType) < 0)
+        return;
+    if (PyType_Ready(&NetfilterLookupHandleType) < 0)
+        return;
+    if (PyType_Ready(&NetfilterDumpHandleType) < 0)
+        return;
+    if (PyType_Ready(&NetfilterPacerHandleType) < 0)
+        return;
+    if (PyType_Ready(&NetfilterFanoutHandleType) < 0)
+        return;
+    if (PyType_Ready(&NetfilterEmulatorHandleType) < 0)
+        return;
 
     module = Py_InitModule("libnftnlset", libnftnlset_methods);
     if (module == NULL)
@@ -865,9 +5815,33 @@ PyMODINIT_FUNC initlibnftnlset (void) {
     Py_INCREF((PyObject*) &NetfilterSetHandleType);
     PyModule_AddObject(module, "NetfilterSetHandle", (PyObject*) &NetfilterSetHandleType);
 
+    Py_INCREF((PyObject*) &NetfilterStoreHandleType);
+    PyModule_AddObject(module, "NetfilterStoreHandle", (PyObject*) &NetfilterStoreHandleType);
+
     Py_INCREF((PyObject*) &NetfilterBatchHandleType);
     PyModule_AddObject(module, "NetfilterBatchHandle", (PyObject*) &NetfilterBatchHandleType);
 
+    Py_INCREF((PyObject*) &NetfilterSocketHandleType);
+    PyModule_AddObject(module, "NetfilterSocketHandle", (PyObject*) &NetfilterSocketHandleType);
+
+    Py_INCREF((PyObject*) &NetfilterCacheHandleType);
+    PyModule_AddObject(module, "NetfilterCacheHandle", (PyObject*) &NetfilterCacheHandleType);
+
+    Py_INCREF((PyObject*) &NetfilterLookupHandleType);
+    PyModule_AddObject(module, "NetfilterLookupHandle", (PyObject*) &NetfilterLookupHandleType);
+
+    Py_INCREF((PyObject*) &NetfilterDumpHandleType);
+    PyModule_AddObject(module, "NetfilterDumpHandle", (PyObject*) &NetfilterDumpHandleType);
+
+    Py_INCREF((PyObject*) &NetfilterPacerHandleType);
+    PyModule_AddObject(module, "NetfilterPacerHandle", (PyObject*) &NetfilterPacerHandleType);
+
+    Py_INCREF((PyObject*) &NetfilterFanoutHandleType);
+    PyModule_AddObject(module, "NetfilterFanoutHandle", (PyObject*) &NetfilterFanoutHandleType);
+
+    Py_INCREF((PyObject*) &NetfilterEmulatorHandleType);
+    PyModule_AddObject(module, "NetfilterEmulatorHandle", (PyObject*) &NetfilterEmulatorHandleType);
+
     /* Message Types */
 
     PyModule_AddIntConstant(module, "NLMSG_NOOP", NLMSG_NOOP);
@@ -900,13 +5874,28 @@ PyMODINIT_FUNC initlibnftnlset (void) {
     PyModule_AddIntConstant(module, "NFT_SET_TIMEOUT", NFT_SET_TIMEOUT);
     PyModule_AddIntConstant(module, "NFT_SET_EVAL", NFT_SET_EVAL);
     PyModule_AddIntConstant(module, "NFT_SET_OBJECT", NFT_SET_OBJECT);
+    PyModule_AddIntConstant(module, "NFT_SET_CONCAT", NFT_SET_CONCAT);
+
+    /* Set Policies */
+
+    PyModule_AddIntConstant(module, "NFT_SET_POL_PERFORMANCE", NFT_SET_POL_PERFORMANCE);
+    PyModule_AddIntConstant(module, "NFT_SET_POL_MEMORY", NFT_SET_POL_MEMORY);
 
     /* Element Flags */
 
     PyModule_AddIntConstant(module, "NFT_SET_ELEM_INTERVAL_END", NFT_SET_ELEM_INTERVAL_END);
 
+    /* Element Expressions */
+
+    PyModule_AddIntConstant(module, "NF_NFTNL_EXPR_COUNTER", NF_NFTNL_EXPR_COUNTER);
+    PyModule_AddIntConstant(module, "NF_NFTNL_EXPR_QUOTA", NF_NFTNL_EXPR_QUOTA);
+    PyModule_AddIntConstant(module, "NF_NFTNL_EXPR_LIMIT", NF_NFTNL_EXPR_LIMIT);
+    PyModule_AddIntConstant(module, "NF_NFTNL_EXPR_CONNLIMIT", NF_NFTNL_EXPR_CONNLIMIT);
+
     /* Protocol Families */
 
+    PyModule_AddIntConstant(module, "NFPROTO_UNSPEC", NFPROTO_UNSPEC);
+    PyModule_AddIntConstant(module, "NFPROTO_INET", NFPROTO_INET);
     PyModule_AddIntConstant(module, "NFPROTO_IPV4", NFPROTO_IPV4);
     PyModule_AddIntConstant(module, "NFPROTO_IPV6", NFPROTO_IPV6);
     PyModule_AddIntConstant(module, "NFPROTO_BRIDGE", NFPROTO_BRIDGE);
@@ -25,5 +25,5 @@ setup(name="python-libnftnl-set",
       ext_modules=[Extension(
           name="libnftnlset",
           sources=["libnftnlset.c"],
-          libraries=["nftnl", "mnl"]
+          libraries=["nftnl", "mnl", "pthread"]
       )])
@@ -0,0 +1,123 @@
+"""Checks the messages the batch handle encodes for element lists, serial
+and sharded over worker threads."""
+
+import unittest
+
+import libnftnlset
+
+from common import (BUFSIZE, FAMILY, NFNL_MSG_BATCH_BEGIN, NFNL_MSG_BATCH_END,
+                    NFT_MSG_NEWSETELEM, EmulatorTestCase, element_keys,
+                    make_keys, make_set, messages)
+
+COUNT = 20000
+WORKERS = 4
+
+
+def encode(method, *args):
+    nf_batch = libnftnlset.batch()
+    nf_batch.begin(BUFSIZE)
+    if method:
+        getattr(nf_batch, method)(*args)
+    nf_batch.end()
+    return nf_batch.dump()
+
+
+def types(request):
+    return [msg_type for msg_type, flags, seq, payload in messages(request)]
+
+
+def unnumbered(request):
+    return [(msg_type, flags, payload) for msg_type, flags, seq, payload in messages(request)]
+
+
+def make_elements(nf_set, keys):
+    for i in xrange(0, len(keys), 4):
+        nf_elem = libnftnlset.element()
+        nf_elem.key = keys[i:i + 4]
+        nf_set.add(nf_elem)
+    return nf_set
+
+
+class EmptySetTest(unittest.TestCase):
+
+    def test_empty_set_adds_no_message(self):
+        nf_set = make_set('empty')
+        nf_elem = libnftnlset.element()
+        nf_elem.key = 'abcd'
+        nf_set.add(nf_elem)
+        nf_set.clear()
+        empty = types(encode(None))
+        self.assertEqual(len(empty), 2)
+        self.assertEqual(types(encode('elem_put', nf_set, FAMILY, True)), empty)
+        self.assertEqual(types(encode('elem_del', nf_set, FAMILY, True)), empty)
+        self.assertEqual(types(encode('elem_del_parallel', nf_set, FAMILY, True, WORKERS)), empty)
+
+
+class ParallelTest(unittest.TestCase):
+
+    def check(self, serial, parallel, keys):
+        serial = messages(serial)
+        parallel = messages(parallel)
+        for batch in (serial, parallel):
+            self.assertEqual(batch[0][0], NFNL_MSG_BATCH_BEGIN)
+            self.assertEqual(batch[-1][0], NFNL_MSG_BATCH_END)
+            self.assertTrue(all(msg[0] == NFT_MSG_NEWSETELEM for msg in batch[1:-1]))
+            # Numbered one after the other, across shard boundaries too
+            self.assertEqual([msg[2] - batch[0][2] for msg in batch], range(len(batch)))
+            self.assertEqual(''.join(''.join(element_keys(msg[3])) for msg in batch[1:-1]), keys)
+
+        # Every shard starts a message of its own, and the first message of
+        # the first shard is the one the serial path builds
+        count = len(keys) / 4
+        firsts = []
+        offset = 0
+        for msg in parallel[1:-1]:
+            firsts.append(offset)
+            offset += len(element_keys(msg[3]))
+        for i in xrange(WORKERS):
+            self.assertIn(count * i / WORKERS, firsts)
+        self.assertTrue(len(parallel) >= len(serial))
+        self.assertEqual(parallel[1][:2] + parallel[1][3:], serial[1][:2] + serial[1][3:])
+
+    def test_keys_put_matches_serial(self):
+        keys = make_keys(COUNT)
+        nf_set = make_set('sharded')
+        serial = encode('elem_put', make_elements(make_set('sharded'), keys), FAMILY, True)
+        parallel = encode('keys_put', nf_set, keys, FAMILY, True, WORKERS)
+        self.check(serial, parallel, keys)
+        self.assertEqual(unnumbered(encode('keys_put', nf_set, keys, FAMILY, True, 1)), unnumbered(serial))
+
+    def test_elem_put_parallel_matches_serial(self):
+        keys = make_keys(COUNT)
+        nf_set = make_elements(make_set('sharded'), keys)
+        serial = encode('elem_put', nf_set, FAMILY, True)
+        parallel = encode('elem_put_parallel', nf_set, FAMILY, True, WORKERS)
+        self.check(serial, parallel, keys)
+
+
+class ParallelEmulatorTest(EmulatorTestCase):
+
+    def test_keys_put_is_committed(self):
+        nf_set = make_set('sharded')
+        self.put_set(nf_set)
+        nf_batch = libnftnlset.batch()
+        nf_batch.begin(BUFSIZE)
+        nf_batch.keys_put(nf_set, make_keys(COUNT), FAMILY, True, WORKERS)
+        nf_batch.end()
+        self.assertEqual(self.run_batch(nf_batch.dump()), 0)
+        self.assertEqual(self.emulator.count('filter', 'sharded', FAMILY), COUNT)
+
+    def test_elem_put_parallel_is_committed(self):
+        nf_set = make_set('sharded')
+        self.put_set(nf_set)
+        make_elements(nf_set, make_keys(COUNT))
+        nf_batch = libnftnlset.batch()
+        nf_batch.begin(BUFSIZE)
+        nf_batch.elem_put_parallel(nf_set, FAMILY, True, WORKERS)
+        nf_batch.end()
+        self.assertEqual(self.run_batch(nf_batch.dump()), 0)
+        self.assertEqual(self.emulator.count('filter', 'sharded', FAMILY), COUNT)
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,70 @@
+"""Feeds set dumps and generation answers from the emulator to cache()."""
+
+import unittest
+
+import libnftnlset
+
+from common import BUFSIZE, FAMILY, EmulatorTestCase, make_set
+
+
+class CacheTest(EmulatorTestCase):
+
+    def feed(self, nf_cache, request):
+        self.raw.send(request)
+        status = 1
+        while status > 0:
+            status = nf_cache.feed(self.raw.recv(BUFSIZE))
+        return status
+
+    def feed_gen(self, nf_cache):
+        self.raw.send(nf_cache.gen_request())
+        nf_cache.feed(self.raw.recv(BUFSIZE))
+
+    def test_cache_sees_sets(self):
+        self.put_set(make_set('cached', 4, 4, libnftnlset.NFT_SET_MAP))
+        nf_cache = libnftnlset.cache()
+        self.feed_gen(nf_cache)
+        self.assertEqual(nf_cache.generation(), self.emulator.generation())
+        self.assertEqual(self.feed(nf_cache, nf_cache.sets_request(FAMILY)), 0)
+        self.assertFalse(nf_cache.interrupted())
+
+        nf_set = nf_cache.get('filter', 'cached', FAMILY)
+        self.assertIsNotNone(nf_set)
+        self.assertEqual(nf_set.key_len, 4)
+        self.assertEqual(nf_set.data_len, 4)
+        self.assertIsNone(nf_cache.get('filter', 'missing', FAMILY))
+
+    def test_dump_before_generation_is_kept(self):
+        self.put_set(make_set('early'))
+        nf_cache = libnftnlset.cache()
+        self.assertEqual(self.feed(nf_cache, nf_cache.sets_request(FAMILY)), 0)
+        self.assertIsNone(nf_cache.generation())
+        self.feed_gen(nf_cache)
+        self.assertEqual(nf_cache.generation(), self.emulator.generation())
+        self.assertIsNotNone(nf_cache.get('filter', 'early', FAMILY))
+
+    def test_dump_is_tagged_with_its_own_generation(self):
+        self.put_set(make_set('first'))
+        nf_cache = libnftnlset.cache()
+        self.feed_gen(nf_cache)
+        generation = nf_cache.generation()
+
+        # The ruleset moves on before the dump: the generation fed earlier
+        # does not describe the dump, the dump itself is kept
+        self.put_set(make_set('second'))
+        self.assertEqual(self.feed(nf_cache, nf_cache.sets_request(FAMILY)), 0)
+        self.assertIsNone(nf_cache.generation())
+        self.assertIsNotNone(nf_cache.get('filter', 'second', FAMILY))
+        self.feed_gen(nf_cache)
+        self.assertNotEqual(nf_cache.generation(), generation)
+        self.assertIsNotNone(nf_cache.get('filter', 'second', FAMILY))
+
+        # A newer generation drops the dump
+        self.put_set(make_set('third'))
+        self.feed_gen(nf_cache)
+        self.assertEqual(nf_cache.generation(), self.emulator.generation())
+        self.assertIsNone(nf_cache.get('filter', 'first', FAMILY))
+
+
+if __name__ == '__main__':
+    unittest.main()
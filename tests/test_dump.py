@@ -0,0 +1,39 @@
+"""Dumps sets filled through the emulator with elem_dump()."""
+
+import errno
+import struct
+import unittest
+
+import libnftnlset
+
+from common import BUFSIZE, FAMILY, EmulatorTestCase, make_keys, make_set
+
+
+class DumpTest(EmulatorTestCase):
+
+    def test_dump_every_element(self):
+        nf_set = make_set('dumped')
+        self.put_set(nf_set)
+        nf_store = libnftnlset.store(4, 0)
+        nf_store.extend(make_keys(5000))
+        self.assertEqual(self.put_store(nf_set, nf_store), 0)
+
+        nf_dump = libnftnlset.elem_dump(nf_set, FAMILY)
+        self.raw.send(nf_dump.request())
+        while nf_dump.feed(self.raw.recv(BUFSIZE)) > 0:
+            pass
+        self.assertEqual(nf_dump.error(), 0)
+        self.assertEqual(len(nf_dump), 5000)
+        keys = struct.unpack('>%dI' % len(nf_dump), nf_dump.keys())
+        self.assertEqual(sorted(keys), range(5000))
+        self.assertEqual(len(struct.unpack('=%dQ' % len(nf_dump), nf_dump.packets())), 5000)
+
+    def test_dump_missing_set(self):
+        nf_dump = libnftnlset.elem_dump(make_set('missing'), FAMILY)
+        self.raw.send(nf_dump.request())
+        self.assertTrue(nf_dump.feed(self.raw.recv(BUFSIZE)) < 0)
+        self.assertEqual(nf_dump.error(), -errno.ENOENT)
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,100 @@
+"""Checks that the in-process emulator answers like nf_tables does. The
+other test modules drive the helpers against it, so none of them needs
+privileges or kernel support.
+
+Build the module in place first:
+
+    python setup.py build_ext --inplace
+    python -m unittest discover tests
+"""
+
+import errno
+import struct
+import time
+import unittest
+
+import libnftnlset
+
+from common import BUFSIZE, FAMILY, NFT_MSG_NEWSETELEM, EmulatorTestCase, make_keys, make_set
+
+
+class TimeoutTest(EmulatorTestCase):
+
+    def test_expired_elements_are_absent(self):
+        nf_set = make_set('expiring', flags=libnftnlset.NFT_SET_TIMEOUT)
+        nf_set.timeout = 50
+        self.put_set(nf_set)
+        nf_store = libnftnlset.store(4, 0)
+        nf_store.add('abcd')
+        self.assertEqual(self.put_store(nf_set, nf_store), 0)
+        self.assertEqual(self.emulator.count('filter', 'expiring', FAMILY), 1)
+        time.sleep(0.1)
+        self.assertEqual(self.emulator.count('filter', 'expiring', FAMILY), 0)
+
+        nf_batch = libnftnlset.batch()
+        nf_batch.begin(BUFSIZE)
+        nf_batch.store_del(nf_set, nf_store, FAMILY, True)
+        nf_batch.end()
+        self.assertEqual(self.run_batch(nf_batch.dump()), -errno.ENOENT)
+        self.assertEqual(self.put_store(nf_set, nf_store), 0)
+
+    def test_data_outside_map(self):
+        nf_set = make_set('plain')
+        self.put_set(nf_set)
+        nf_store = libnftnlset.store(4, 4)
+        nf_store.add('abcd', 'data')
+        self.assertEqual(self.put_store(nf_set, nf_store), -errno.EINVAL)
+
+
+
+class ElementListTest(EmulatorTestCase):
+
+    def fill(self, name):
+        nf_set = make_set(name)
+        self.put_set(nf_set)
+        nf_store = libnftnlset.store(4, 0)
+        nf_store.extend(make_keys(10))
+        self.assertEqual(self.put_store(nf_set, nf_store), 0)
+        return nf_set
+
+    def flush_request(self, nf_set):
+        nf_batch = libnftnlset.batch()
+        nf_batch.begin(BUFSIZE)
+        nf_batch.elem_flush(nf_set, FAMILY, True)
+        nf_batch.end()
+        return nf_batch.dump()
+
+    def test_empty_delete_flushes(self):
+        self.fill('flushed')
+        self.assertEqual(self.run_batch(self.flush_request(make_set('flushed'))), 0)
+        self.assertEqual(self.emulator.count('filter', 'flushed', FAMILY), 0)
+
+    def test_empty_add_is_refused(self):
+        self.fill('refused')
+        # The flush turned into a NEWSETELEM without elements
+        request = self.flush_request(make_set('refused'))
+        offset = struct.unpack_from('=I', request, 0)[0]
+        request = request[:offset + 4] + struct.pack('=H', NFT_MSG_NEWSETELEM) + request[offset + 6:]
+        self.assertEqual(self.run_batch(request), -errno.EINVAL)
+        self.assertEqual(self.emulator.count('filter', 'refused', FAMILY), 10)
+
+    def test_cleared_set_handle_leaves_set_alone(self):
+        nf_set = self.fill('cleared')
+        nf_elem = libnftnlset.element()
+        nf_elem.key = struct.pack('>I', 1)
+        nf_set.add(nf_elem)
+        nf_set.clear()
+        added = libnftnlset.store(4, 0)
+        added.extend(make_keys(1, 10))
+        nf_batch = libnftnlset.batch()
+        nf_batch.begin(BUFSIZE)
+        nf_batch.elem_del(nf_set, FAMILY, True)
+        nf_batch.elem_put(nf_set, FAMILY, True)
+        nf_batch.store_put(nf_set, added, FAMILY, True)
+        nf_batch.end()
+        self.assertEqual(self.run_batch(nf_batch.dump()), 0)
+        self.assertEqual(self.emulator.count('filter', 'cleared', FAMILY), 11)
+
+
+if __name__ == '__main__':
+    unittest.main()
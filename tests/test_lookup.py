@@ -0,0 +1,52 @@
+"""Answers lookup_many() windows from the emulator, overruns included."""
+
+import struct
+import unittest
+
+import libnftnlset
+
+from common import BUFSIZE, FAMILY, EmulatorTestCase, bit, make_keys, make_set
+
+
+class LookupTest(EmulatorTestCase):
+
+    def test_lookup_in_windows(self):
+        nf_set = make_set('lookup', 4, 4, libnftnlset.NFT_SET_MAP)
+        self.put_set(nf_set)
+        nf_store = libnftnlset.store(4, 4)
+        for i in xrange(0, 200, 2):
+            nf_store.add(struct.pack('>I', i), struct.pack('>I', i * 10))
+        self.assertEqual(self.put_store(nf_set, nf_store), 0)
+
+        nf_lookup = libnftnlset.lookup_many(nf_set, make_keys(200), FAMILY, 16)
+        remaining = 200
+        windows = 0
+        while remaining > 0:
+            request = nf_lookup.request()
+            if request:
+                windows += 1
+                self.raw.send(request)
+            remaining = nf_lookup.feed(self.raw.recv(BUFSIZE))
+
+        self.assertEqual(windows, 200 / 16 + 1)
+        self.assertEqual(nf_lookup.error(), 0)
+        found = nf_lookup.found()
+        data = nf_lookup.data()
+        for i in xrange(200):
+            self.assertEqual(bit(found, i), i % 2 == 0)
+            if i % 2 == 0:
+                self.assertEqual(struct.unpack('>I', data[i * 4:i * 4 + 4])[0], i * 10)
+
+    def test_overrun_asks_again(self):
+        nf_set = make_set('overrun')
+        self.put_set(nf_set)
+        nf_lookup = libnftnlset.lookup_many(nf_set, make_keys(8), FAMILY, 4)
+        self.assertTrue(nf_lookup.request())
+        self.assertEqual(nf_lookup.request(), '')
+        self.assertEqual(nf_lookup.overrun(), 4)
+        self.assertEqual(nf_lookup.answered(), '\x00')
+        self.assertTrue(nf_lookup.request())
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,109 @@
+"""Drains stores through pacer() transactions committed by the emulator."""
+
+import errno
+import time
+import unittest
+
+import libnftnlset
+
+from common import BUFSIZE, FAMILY, EmulatorTestCase, make_keys, make_set
+
+
+class PacerTest(EmulatorTestCase):
+
+    def drain(self, nf_pacer, nf_set, nf_store, delete=False):
+        failed = []
+        while True:
+            request = nf_pacer.next(nf_set, nf_store, FAMILY, BUFSIZE, delete)
+            if request is None:
+                return failed
+            try:
+                nf_pacer.ack(self.run_batch(request))
+            except OSError as e:
+                failed.append((e.errno, e.strerror))
+
+    def test_pacer_drains_store(self):
+        nf_set = make_set('paced')
+        self.put_set(nf_set)
+        nf_store = libnftnlset.store(4, 0)
+        nf_store.extend(make_keys(3000))
+        nf_pacer = libnftnlset.pacer(0.001, 0, 1, 64, 1024)
+        self.assertEqual(self.drain(nf_pacer, nf_set, nf_store), [])
+        self.assertEqual(nf_pacer.inflight, 0)
+        self.assertEqual(nf_pacer.offset, 3000)
+        self.assertEqual(self.emulator.count('filter', 'paced', FAMILY), 3000)
+
+    def test_only_failed_transaction_is_handed_out_again(self):
+        nf_set = make_set('repaced')
+        nf_store = libnftnlset.store(4, 0)
+        nf_store.extend(make_keys(100))
+        nf_pacer = libnftnlset.pacer(0.001, 0, 1, 10, 100)
+
+        # The set does not exist yet when the first transaction is
+        # committed, and does when the second one is: the first one is
+        # given up on, the second one is not handed out again
+        first = nf_pacer.next(nf_set, nf_store, FAMILY, BUFSIZE)
+        second = nf_pacer.next(nf_set, nf_store, FAMILY, BUFSIZE)
+        self.assertEqual(nf_pacer.offset, 20)
+        self.assertRaises(OSError, nf_pacer.ack, self.run_batch(first))
+        self.put_set(nf_set)
+        nf_pacer.ack(self.run_batch(second))
+        self.assertEqual(nf_pacer.offset, 20)
+        self.assertEqual(nf_pacer.retrying, 0)
+
+        # Larger transactions are split, min_size ones are given up on
+        nf_pacer = libnftnlset.pacer(0.001, 0, 1, 5, 100)
+        nf_pacer.next(nf_set, nf_store, FAMILY, BUFSIZE)
+        nf_pacer.ack(0, 0.00001)
+        self.assertEqual(nf_pacer.size, 10)
+        missing = make_set('missing')
+        nf_pacer.ack(self.run_batch(nf_pacer.next(missing, nf_store, FAMILY, BUFSIZE)))
+        self.assertEqual((nf_pacer.offset, nf_pacer.retrying, nf_pacer.size), (15, 10, 5))
+        nf_pacer.next(nf_set, nf_store, FAMILY, BUFSIZE)
+        request = nf_pacer.next(missing, nf_store, FAMILY, BUFSIZE)
+        self.assertEqual((nf_pacer.offset, nf_pacer.retrying), (15, 0))
+        nf_pacer.ack(0, 0.00001)
+        self.assertRaises(OSError, nf_pacer.ack, self.run_batch(request))
+        self.assertIsNotNone(nf_pacer.next(nf_set, nf_store, FAMILY, BUFSIZE))
+        self.assertEqual(nf_pacer.offset, 15 + nf_pacer.size)
+
+    def test_failed_deletes_are_not_repeated(self):
+        # Every key but one is in the set: deleting them all fails only
+        # for the transactions that hold the missing key
+        nf_set = make_set('deleted')
+        self.put_set(nf_set)
+        present = libnftnlset.store(4, 0)
+        present.extend(make_keys(37))
+        present.extend(make_keys(62, 38))
+        self.assertEqual(self.put_store(nf_set, present), 0)
+
+        nf_store = libnftnlset.store(4, 0)
+        nf_store.extend(make_keys(100))
+        nf_pacer = libnftnlset.pacer(0.001, 0, 1, 1, 64)
+        failed = self.drain(nf_pacer, nf_set, nf_store, True)
+        self.assertEqual(len(failed), 1)
+        self.assertEqual(failed[0][0], errno.ENOENT)
+        self.assertIn('37 to 38', failed[0][1])
+        self.assertEqual(nf_pacer.retrying, 0)
+        self.assertEqual(nf_pacer.inflight, 0)
+        self.assertEqual(self.emulator.count('filter', 'deleted', FAMILY), 0)
+
+    def test_rate_is_enforced_by_next(self):
+        nf_set = make_set('rated')
+        self.put_set(nf_set)
+        nf_store = libnftnlset.store(4, 0)
+        nf_store.extend(make_keys(100))
+        nf_pacer = libnftnlset.pacer(0.001, 20, 2, 10, 10)
+        self.assertTrue(nf_pacer.next(nf_set, nf_store, FAMILY, BUFSIZE))
+        self.assertTrue(nf_pacer.next(nf_set, nf_store, FAMILY, BUFSIZE))
+        self.assertEqual(nf_pacer.next(nf_set, nf_store, FAMILY, BUFSIZE), '')
+        self.assertEqual(nf_pacer.offset, 20)
+        delay = nf_pacer.delay()
+        self.assertTrue(0 < delay <= 0.05)
+        time.sleep(delay)
+        self.assertTrue(nf_pacer.next(nf_set, nf_store, FAMILY, BUFSIZE))
+        self.assertEqual(nf_pacer.offset, 30)
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,51 @@
+"""Checks how set handles hand their elements back on clear() and
+discard(); no socket is involved."""
+
+import unittest
+
+import libnftnlset
+
+
+def make_element(key):
+    nf_elem = libnftnlset.element()
+    nf_elem.key = key
+    return nf_elem
+
+
+class ReleaseTest(unittest.TestCase):
+
+    def test_clear_hands_elements_back(self):
+        first = libnftnlset.set()
+        second = libnftnlset.set()
+        nf_elem = make_element('abcd')
+        first.add(nf_elem)
+        self.assertRaises(ValueError, second.add, nf_elem)
+        self.assertIsNone(first.clear())
+        self.assertEqual(len(first), 0)
+        second.add(nf_elem)
+        self.assertEqual(len(second), 1)
+        self.assertEqual(nf_elem.key, 'abcd')
+
+    def test_discard_hands_matching_elements_back(self):
+        first = libnftnlset.set()
+        second = libnftnlset.set()
+        kept = make_element('abcd')
+        dropped = make_element('efgh')
+        first.add(kept)
+        first.add(dropped)
+        self.assertIsNone(first.discard('efgh'))
+        self.assertEqual(len(first), 1)
+        self.assertRaises(ValueError, second.add, kept)
+        second.add(dropped)
+
+    def test_released_element_outlives_set(self):
+        nf_set = libnftnlset.set()
+        nf_set.add(make_element('abcd'))
+        nf_elem = list(nf_set)[0]
+        nf_set.clear()
+        del nf_set
+        self.assertEqual(nf_elem.key, 'abcd')
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,86 @@
+"""Drives batches through socket() against the emulator: commits,
+rollbacks, errors after acknowledged messages, separate connections."""
+
+import errno
+import select
+import struct
+import unittest
+
+import libnftnlset
+
+from common import BUFSIZE, FAMILY, EmulatorTestCase, make_keys, make_set
+
+
+class SocketTest(EmulatorTestCase):
+
+    def test_batch_is_committed(self):
+        nf_set = make_set('committed')
+        self.put_set(nf_set)
+        nf_store = libnftnlset.store(4, 0)
+        nf_store.extend(make_keys(100))
+        self.assertEqual(self.put_store(nf_set, nf_store), 0)
+        self.assertEqual(self.emulator.count('filter', 'committed', FAMILY), 100)
+
+    def test_failing_batch_is_rolled_back(self):
+        nf_set = make_set('rollback')
+        self.put_set(nf_set)
+        added = libnftnlset.store(4, 0)
+        added.extend(make_keys(10))
+        missing = libnftnlset.store(4, 0)
+        missing.add(struct.pack('>I', 1000))
+
+        nf_batch = libnftnlset.batch()
+        nf_batch.begin(BUFSIZE)
+        nf_batch.store_put(nf_set, added, FAMILY, True)
+        nf_batch.store_del(nf_set, missing, FAMILY, True)
+        nf_batch.end()
+        commits = self.emulator.commits()
+        self.assertEqual(self.run_batch(nf_batch.dump()), -errno.ENOENT)
+        self.assertEqual(self.emulator.count('filter', 'rollback', FAMILY), 0)
+        self.assertEqual(self.emulator.commits(), commits)
+
+    def test_error_before_acknowledged_message(self):
+        # The set message asks for an acknowledgement of its own, the
+        # element message after it fails: the batch reports the failure
+        nf_set = make_set('early_ack')
+        nf_batch = libnftnlset.batch()
+        nf_batch.begin(BUFSIZE)
+        nf_batch.set_put(nf_set, FAMILY, True)
+        missing = make_set('no_such_set')
+        nf_elem = libnftnlset.element()
+        nf_elem.key = 'abcd'
+        missing.add(nf_elem)
+        nf_batch.elem_put(missing, FAMILY, False)
+        nf_batch.end()
+        self.assertEqual(self.run_batch(nf_batch.dump()), -errno.ENOENT)
+
+    def test_sockets_do_not_share_answers(self):
+        other = self.emulator.socket()
+        nf_set = make_set('shared')
+        nf_batch = libnftnlset.batch()
+        nf_batch.begin(BUFSIZE)
+        nf_batch.set_put(nf_set, FAMILY, True)
+        nf_batch.end()
+        request = nf_batch.dump()
+        first = self.sock.queue(request)
+        second = other.queue(request)
+        results = {}
+        while len(results) < 2:
+            select.select([self.sock, other], [], [], 5)
+            for sock in (self.sock, other):
+                for batch_seq, error in sock.process_ready():
+                    results[sock] = (batch_seq, error)
+        self.assertEqual(results[self.sock], (first, 0))
+        self.assertEqual(results[other], (second, 0))
+
+    def test_socket_keeps_emulator_alive(self):
+        sock = libnftnlset.emulator().socket()
+        nf_batch = libnftnlset.batch()
+        nf_batch.begin(BUFSIZE)
+        nf_batch.set_put(make_set('orphan'), FAMILY, True)
+        nf_batch.end()
+        self.assertEqual(self.run_batch(nf_batch.dump(), sock), -errno.ENOENT)
+
+
+if __name__ == '__main__':
+    unittest.main()
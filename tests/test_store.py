@@ -0,0 +1,73 @@
+"""Checks what store() records encode to, and commits them through the
+emulator."""
+
+import unittest
+
+import libnftnlset
+
+from common import (BUFSIZE, FAMILY, NFT_MSG_DELSETELEM, NFT_MSG_NEWSETELEM,
+                    EmulatorTestCase, element_keys, make_keys, make_set, messages)
+
+
+def encode(method, nf_set, nf_store):
+    nf_batch = libnftnlset.batch()
+    nf_batch.begin(BUFSIZE)
+    getattr(nf_batch, method)(nf_set, nf_store, FAMILY, True)
+    nf_batch.end()
+    return messages(nf_batch.dump())[1:-1]
+
+
+class StoreTest(unittest.TestCase):
+
+    def test_records_are_encoded_in_order(self):
+        keys = make_keys(5000)
+        nf_store = libnftnlset.store(4, 0)
+        nf_store.extend(keys)
+        for method, msg_type in (('store_put', NFT_MSG_NEWSETELEM), ('store_del', NFT_MSG_DELSETELEM)):
+            batch = encode(method, make_set('stored'), nf_store)
+            self.assertTrue(len(batch) > 1)
+            self.assertTrue(all(msg[0] == msg_type for msg in batch))
+            self.assertEqual(''.join(''.join(element_keys(msg[3])) for msg in batch), keys)
+
+    def test_concatenated_fields_are_padded(self):
+        nf_store = libnftnlset.store((4, 2), 0)
+        nf_store.add('\x0a\x00\x00\x01\x00\x50')
+        batch = encode('store_put', make_set('concat', 8), nf_store)
+        self.assertEqual(element_keys(batch[0][3]), ['\x0a\x00\x00\x01\x00\x50\x00\x00'])
+
+    def test_records_are_checked(self):
+        nf_store = libnftnlset.store(4, 4)
+        self.assertRaises(ValueError, nf_store.add, 'abc', 'data')
+        self.assertRaises(ValueError, nf_store.add, 'abcd', 'dat')
+        self.assertRaises(ValueError, nf_store.extend, 'abcdefg', None)
+        self.assertRaises(ValueError, nf_store.extend, 'abcdefgh', 'data')
+        nf_store.add('abcd', 'data')
+        self.assertRaises(ValueError, encode, 'store_put', make_set('mismatch', 8), nf_store)
+
+    def test_clear_empties_the_store(self):
+        nf_store = libnftnlset.store(4, 0)
+        nf_store.extend(make_keys(100))
+        nf_store.clear()
+        self.assertEqual(encode('store_put', make_set('cleared'), nf_store), [])
+
+
+class StoreEmulatorTest(EmulatorTestCase):
+
+    def test_store_is_committed_and_removed(self):
+        nf_set = make_set('stored', 4, 4, libnftnlset.NFT_SET_MAP)
+        self.put_set(nf_set)
+        nf_store = libnftnlset.store(4, 4)
+        nf_store.extend(make_keys(3000), make_keys(3000, 1))
+        self.assertEqual(self.put_store(nf_set, nf_store), 0)
+        self.assertEqual(self.emulator.count('filter', 'stored', FAMILY), 3000)
+
+        nf_batch = libnftnlset.batch()
+        nf_batch.begin(BUFSIZE)
+        nf_batch.store_del(nf_set, nf_store, FAMILY, True)
+        nf_batch.end()
+        self.assertEqual(self.run_batch(nf_batch.dump()), 0)
+        self.assertEqual(self.emulator.count('filter', 'stored', FAMILY), 0)
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,64 @@
+"""Checks the backends tune() expects the kernel to pick; no socket is
+involved."""
+
+import unittest
+
+import libnftnlset
+
+PIPAPO = ('pipapo', 'pipapo_avx2')
+
+# (key_len, count, flags, fields, expected backends)
+BACKENDS = [
+    (4, 1000000, 0, (), ('hash_fast',)),
+    (4, 1000000, libnftnlset.NFT_SET_TIMEOUT, (), ('rhash',)),
+    (4, 0, 0, (), ('rhash',)),
+    (16, 1000, 0, (), ('hash',)),
+    (1, 100, 0, (), ('bitmap',)),
+    (2, 1000, 0, (), ('bitmap',)),
+    (4, 1000, libnftnlset.NFT_SET_INTERVAL, (), ('rbtree',)),
+    (0, 10000, libnftnlset.NFT_SET_INTERVAL, (4, 2), PIPAPO),
+]
+
+
+def make_set(key_len, flags=0):
+    nf_set = libnftnlset.set()
+    if key_len:
+        nf_set.key_len = key_len
+    nf_set.flags = flags
+    return nf_set
+
+
+class TuneTest(unittest.TestCase):
+
+    def test_backends(self):
+        for key_len, count, flags, fields, expected in BACKENDS:
+            nf_set = make_set(key_len)
+            backend = nf_set.tune(count, flags, fields)
+            self.assertIn(backend, expected, (key_len, count, flags, fields, backend))
+            self.assertEqual(nf_set.flags & flags, flags)
+
+    def test_repeatable_in_any_order(self):
+        nf_set = make_set(4, libnftnlset.NFT_SET_MAP)
+        self.assertEqual(nf_set.tune(1000000, 0), 'hash_fast')
+        self.assertEqual(nf_set.tune(1000000, libnftnlset.NFT_SET_TIMEOUT), 'rhash')
+        self.assertEqual(nf_set.tune(1000000, 0), 'hash_fast')
+        self.assertEqual(nf_set.flags, libnftnlset.NFT_SET_MAP)
+
+    def test_fields_are_kept(self):
+        nf_set = make_set(0)
+        self.assertIn(nf_set.tune(10000, libnftnlset.NFT_SET_INTERVAL, (4, 2)), PIPAPO)
+        self.assertIn(nf_set.tune(20000, libnftnlset.NFT_SET_INTERVAL), PIPAPO)
+        self.assertIn(nf_set.tune(20000, libnftnlset.NFT_SET_INTERVAL, (4, 2)), PIPAPO)
+        self.assertEqual(nf_set.key_len, 8)
+        self.assertRaises(ValueError, nf_set.tune, 10000, libnftnlset.NFT_SET_INTERVAL, (2, 4))
+        self.assertRaises(ValueError, nf_set.tune, 10000, libnftnlset.NFT_SET_INTERVAL, (4, 2, 2))
+
+    def test_bad_fields(self):
+        self.assertRaises(ValueError, make_set(0).tune, 100, 0)
+        self.assertRaises(ValueError, make_set(0).tune, 100, 0, (0,))
+        self.assertRaises(ValueError, make_set(0).tune, 100, 0, (65,))
+        self.assertRaises(ValueError, make_set(4).tune, 100, 0, (4, 2))
+
+
+if __name__ == '__main__':
+    unittest.main()